@@ -1,6 +1,7 @@
 struct tty_ldisc_ops tty_ldisc_N_TTY = {
 	.magic           = TTY_LDISC_MAGIC,
 	.name            = "n_tty",
+	.flags           = LDISC_FLAG_NOWAIT, // read/write 在 IOCB_NOWAIT 下不睡眠, tty_open() 据此设置 FMODE_NOWAIT
 	.open            = n_tty_open,
 	.close           = n_tty_close,
 	.flush_buffer    = n_tty_flush_buffer,
@@ -14,6 +15,7 @@ struct tty_ldisc_ops tty_ldisc_N_TTY = {
 	.write_wakeup    = n_tty_write_wakeup,
 	.fasync		 = n_tty_fasync,
 	.receive_buf2	 = n_tty_receive_buf2,
+	.take_unread	 = n_tty_take_unread, // 新增的可选回调, 切换线路规程时把没读走的数据交还给 tty_buffer, 见 tty_set_ldisc()
 };
 
 1、 回调函数 o{----------------------------------------------------------------------------------------------------------------
@@ -38,6 +40,7 @@ static int n_tty_open(struct tty_struct *tty)
 	mutex_init(&ldata->atomic_read_lock);
 	mutex_init(&ldata->output_lock);
 
+	ldata->tty = tty; // n_tty_wake_timer() 中通过 ldata 找到 tty
 	tty->disc_data = ldata; // 将上面申请的 n_tty_data 保存到 tty_struct 中，方便后续使用                
 	reset_buffer_flags(struct n_tty_data *ldata = tty->disc_data); {// 初始化 n_tty_data
 		ldata->read_head = ldata->canon_head = ldata->read_tail = 0;
@@ -53,6 +56,11 @@ static int n_tty_open(struct tty_struct *tty)
 	ldata->column = 0;
 	ldata->canon_column = 0;
 	ldata->minimum_to_wake = 1;
+	ldata->wake_bytes = 0; // 默认不合并唤醒, 行为和原来一样
+	ldata->wake_delay_us = 0;
+	hrtimer_init(&ldata->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ldata->wake_timer.function = n_tty_wake_timer; // n_tty_close() 中要 hrtimer_cancel()
+	INIT_WORK(&ldata->unthrottle_work, n_tty_unthrottle_work);
 	ldata->num_overrun = 0;
 	ldata->no_room = 0;
 	ldata->lnext = 0;
@@ -67,6 +75,578 @@ static int n_tty_open(struct tty_struct *tty)
 err:
 	return -ENOMEM;
 }
+
+/**
+ *	n_tty_close		-	close the ldisc for this tty
+ *	@tty: device
+ *
+ *	Called from the terminal layer when this line discipline is
+ *	being shut down, either because of a close or because of a
+ *	discipline change. The function will not be called while other
+ *	ldisc methods are in progress.
+ */
+static void n_tty_close(struct tty_struct *tty)
+{
+	struct n_tty_data *ldata = tty->disc_data;
+
+	if (tty->link)
+		n_tty_packet_mode_flush(tty);
+
+	hrtimer_cancel(&ldata->wake_timer); // 接收已经停止, 不会再启动; 等正在运行的 n_tty_wake_timer() 结束后才能释放 ldata
+	cancel_work_sync(&ldata->unthrottle_work); // 读已经停止, 同上
+
+	down_write(&tty->termios_rwsem);
+	vfree(ldata);
+	tty->disc_data = NULL;
+	up_write(&tty->termios_rwsem);
+}
+
+/**
+ *	n_tty_ioctl		-	ldisc specific ioctls
+ *
+ *	TIOCSWAKEUP/TIOCGWAKEUP set and get the reader wakeup policy, see
+ *	n_tty_wake_reader(). Applies to every reader of the tty.
+ */
+static int n_tty_ioctl(struct tty_struct *tty, struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct n_tty_data *ldata = tty->disc_data;
+	struct tty_wakeup_policy wp;
+	int retval;
+
+	switch (cmd) {
+	case TIOCOUTQ:
+		return put_user(tty_chars_in_buffer(tty), (int __user *) arg);
+	case TIOCINQ:
+		down_write(&tty->termios_rwsem);
+		if (L_ICANON(tty) && !L_EXTPROC(tty))
+			retval = inq_canon(ldata);
+		else
+			retval = read_cnt(ldata);
+		up_write(&tty->termios_rwsem);
+		return put_user(retval, (unsigned int __user *) arg);
+	case TIOCSWAKEUP:
+		if (copy_from_user(&wp, (void __user *) arg, sizeof(wp)))
+			return -EFAULT;
+		if (wp.bytes >= N_TTY_BUF_SIZE || (wp.bytes && !wp.delay_us)) // 只设字节数不设超时, 数据可能永远不会被读走
+			return -EINVAL;
+		if (wp.delay_us > USEC_PER_SEC) // 延迟唤醒最多 1 秒
+			return -EINVAL;
+		down_write(&tty->termios_rwsem);
+		ldata->wake_bytes = wp.bytes;
+		ldata->wake_delay_us = wp.delay_us;
+		/*
+		 * n_tty_wake_reader() runs with termios_rwsem held for reading;
+		 * the receive path may run it concurrently. That is fine: the
+		 * hrtimer calls serialize on the timer base, at worst a pending
+		 * timer is restarted.
+		 */
+		downgrade_write(&tty->termios_rwsem);
+		n_tty_wake_reader(tty); // 按新的策略检查一次已有的数据
+		up_read(&tty->termios_rwsem);
+		return 0;
+	case TIOCGWAKEUP:
+		wp.bytes = ldata->wake_bytes;
+		wp.delay_us = ldata->wake_delay_us;
+		return copy_to_user((void __user *) arg, &wp, sizeof(wp)) ? -EFAULT : 0;
+	default:
+		return n_tty_ioctl_helper(tty, file, cmd, arg);
+	}
+}
+
+/**
+ *	n_tty_read		-	read function for tty
+ *	@tty: tty device
+ *	@file: file object
+ *	@iocb: kernel I/O control block
+ *	@to: destination
+ *
+ *	Perform reads for the line discipline. We are guaranteed that the
+ *	line discipline will not be closed under us but we may get multiple
+ *	parallel readers and must handle this ourselves. We may also get
+ *	a hangup. Always called in user context, may sleep.
+ *
+ *	This code must be sure never to sleep through a hangup.
+ *
+ *	With IOCB_NOWAIT nothing here sleeps: the locks are trylocked, the
+ *	flip buffers are not flushed (only what already is in read_buf is
+ *	returned), an empty read_buf gives -EAGAIN and unthrottling, which
+ *	takes throttle_mutex and calls into the driver, is left to
+ *	ldata->unthrottle_work.
+ *
+ *	n_tty_read()/consumer path:
+ *		claims non-exclusive termios_rwsem
+ *		publishes read_tail
+ */
+static ssize_t n_tty_read(struct tty_struct *tty, struct file *file,
+			  struct kiocb *iocb, struct iov_iter *to)
+{
+	struct n_tty_data *ldata = tty->disc_data;
+	size_t want = iov_iter_count(to);
+	size_t nr = want;
+	DEFINE_WAIT_FUNC(wait, woken_wake_function);
+	int c;
+	int minimum, time;
+	ssize_t retval = 0;
+	long timeout;
+	int packet;
+	size_t tail;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+
+	c = job_control(tty, file);
+	if (c < 0)
+		return c;
+
+	/*
+	 *	Internal serialization of reads.
+	 */
+	if (tty_read_nowait(tty, file, iocb)) { // O_NONBLOCK 或 io_uring 的 IOCB_NOWAIT
+		if (!mutex_trylock(&ldata->atomic_read_lock))
+			return -EAGAIN;
+	} else {
+		if (mutex_lock_interruptible(&ldata->atomic_read_lock))
+			return -ERESTARTSYS;
+	}
+
+	if (!nowait) {
+		down_read(&tty->termios_rwsem);
+	} else if (!down_read_trylock(&tty->termios_rwsem)) { // 正在修改 termios
+		mutex_unlock(&ldata->atomic_read_lock);
+		return -EAGAIN;
+	}
+
+	minimum = time = 0;
+	timeout = MAX_SCHEDULE_TIMEOUT;
+	if (!ldata->icanon) {
+		minimum = MIN_CHAR(tty);
+		if (minimum) {
+			time = (HZ / 10) * TIME_CHAR(tty);
+		} else {
+			timeout = (HZ / 10) * TIME_CHAR(tty);
+			minimum = 1;
+		}
+	}
+
+	packet = tty->packet;
+	tail = ldata->read_tail;
+
+	add_wait_queue(&tty->read_wait, &wait);
+	while (nr) {
+		/* First test for status change. */
+		if (packet && tty->link->ctrl_status) {
+			unsigned char cs;
+			if (nr != want)
+				break;
+			spin_lock_irq(&tty->link->ctrl_lock);
+			cs = tty->link->ctrl_status;
+			tty->link->ctrl_status = 0;
+			spin_unlock_irq(&tty->link->ctrl_lock);
+			if (copy_to_iter(&cs, 1, to) != 1) {
+				retval = -EFAULT;
+				break;
+			}
+			nr--;
+			break;
+		}
+
+		if (!input_available_p(tty, 0)) {
+			if (!nowait) { // flush_work() 会睡眠, IOCB_NOWAIT 时只看 read_buf 中已有的数据
+				up_read(&tty->termios_rwsem);
+				tty_buffer_flush_work(tty->port);
+				down_read(&tty->termios_rwsem);
+			}
+			if (!input_available_p(tty, 0)) {
+				if (test_bit(TTY_OTHER_CLOSED, &tty->flags)) {
+					retval = -EIO;
+					break;
+				}
+				if (tty_hung_up_p(file))
+					break;
+				/*
+				 * Abort readers for ttys which never actually
+				 * get hung up.  See __tty_hangup().
+				 */
+				if (test_bit(TTY_HUPPING, &tty->flags))
+					break;
+				if (!timeout)
+					break;
+				if (tty_read_nowait(tty, file, iocb)) {
+					retval = -EAGAIN;
+					break;
+				}
+				if (signal_pending(current)) {
+					retval = -ERESTARTSYS;
+					break;
+				}
+				up_read(&tty->termios_rwsem);
+
+				timeout = wait_woken(&wait, TASK_INTERRUPTIBLE,
+						timeout);
+
+				down_read(&tty->termios_rwsem);
+				continue;
+			}
+		}
+
+		if (ldata->icanon && !L_EXTPROC(tty)) {
+			retval = canon_copy_from_read_buf(tty, to, &nr); // 原来是拷贝到 unsigned char __user *b
+			if (retval)
+				break;
+		} else {
+			int uncopied;
+
+			/* Deal with packet mode. */
+			if (packet && nr == want) {
+				unsigned char pkt = TIOCPKT_DATA;
+
+				if (copy_to_iter(&pkt, 1, to) != 1) {
+					retval = -EFAULT;
+					break;
+				}
+				nr--;
+			}
+
+			uncopied = copy_from_read_buf(tty, to, &nr);
+			uncopied += copy_from_read_buf(tty, to, &nr); // read_buf 回绕时第二段
+			if (uncopied) {
+				retval = -EFAULT;
+				break;
+			}
+		}
+
+		if (nowait)
+			n_tty_check_unthrottle_nowait(tty);
+		else
+			n_tty_check_unthrottle(tty);
+
+		if (want - nr >= minimum)
+			break;
+		if (time)
+			timeout = time;
+	}
+	if (tail != ldata->read_tail) {
+		trace_n_tty_read(tty, tail, ldata->read_tail, want - nr); // 和 n_tty_receive 事件的 [head, end) 对比, 得到读进程的唤醒延迟
+		n_tty_kick_worker(tty);
+	}
+	up_read(&tty->termios_rwsem);
+
+	remove_wait_queue(&tty->read_wait, &wait);
+	mutex_unlock(&ldata->atomic_read_lock);
+
+	if (want - nr)
+		retval = want - nr;
+
+	return retval;
+}
+
+/**
+ *	n_tty_kick_worker - start input worker (if required)
+ *	@tty: terminal
+ *
+ *	Re-schedules the flip buffer work if it may have stopped
+ *
+ *	Caller holds exclusive termios_rwsem
+ *	   or
+ *	n_tty_read()/consumer path:
+ *		holds non-exclusive termios_rwsem
+ */
+static void n_tty_kick_worker(struct tty_struct *tty)
+{
+	struct n_tty_data *ldata = tty->disc_data;
+
+	/* Did the input worker stop? Restart it */
+	if (unlikely(ldata->no_room)) {
+		ldata->no_room = 0;
+
+		WARN_RATELIMIT(tty->port->itty == NULL,
+				"scheduling with invalid itty\n");
+		/* see if ldisc has been killed - if so, this means that
+		 * even though the ldisc has been halted and ->buf.work
+		 * cancelled, ->buf.work is about to be rescheduled
+		 */
+		WARN_RATELIMIT(test_bit(TTY_LDISC_HALTED, &tty->flags),
+			       "scheduling buffer work for halted ldisc\n");
+		tty_buffer_restart_work(tty->port); // 经 tty_buffer_queue_work(), 遵守 flush_mode 选择的 cpu
+	}
+}
+
+/*
+ * n_tty_check_unthrottle() for IOCB_NOWAIT reads. For a pty it only
+ * kicks flush_to_ldisc() and wakes the other side, which does not
+ * sleep. Otherwise tty_unthrottle_safe() takes throttle_mutex and may
+ * call into a driver that sleeps, so a throttled tty is unthrottled
+ * from a work item; an unthrottled one only needs the kick n_tty_read()
+ * does on its way out.
+ */
+static void n_tty_check_unthrottle_nowait(struct tty_struct *tty)
+{
+	struct n_tty_data *ldata = tty->disc_data;
+
+	if (tty->driver->type == TTY_DRIVER_TYPE_PTY)
+		n_tty_check_unthrottle(tty);
+	else if (tty_throttled(tty))
+		schedule_work(&ldata->unthrottle_work);
+}
+
+static void n_tty_unthrottle_work(struct work_struct *work)
+{
+	struct n_tty_data *ldata = container_of(work, struct n_tty_data, unthrottle_work);
+	struct tty_struct *tty = ldata->tty;
+
+	down_read(&tty->termios_rwsem);
+	n_tty_check_unthrottle(tty);
+	up_read(&tty->termios_rwsem);
+}
+
+/*
+ * output_lock for n_tty_write(). An IOCB_NOWAIT write gets -EAGAIN
+ * instead of waiting for it, which the callers treat like a full
+ * driver buffer.
+ */
+static int n_tty_output_lock(struct n_tty_data *ldata, bool nowait)
+{
+	if (!nowait) {
+		mutex_lock(&ldata->output_lock);
+		return 0;
+	}
+	return mutex_trylock(&ldata->output_lock) ? 0 : -EAGAIN;
+}
+
+/**
+ *	process_output			-	output post processor
+ *	@c: character (or partial unicode symbol)
+ *	@tty: terminal device
+ *	@nowait: IOCB_NOWAIT write, do not wait for output_lock
+ *
+ *	Output one character with OPOST processing.
+ *	Returns -1 when the output device is full and the character
+ *	must be retried.
+ *
+ *	Locking: output_lock to protect column state and space left
+ *		 (also, this is called from n_tty_write under the
+ *		  tty layer write lock)
+ */
+static int process_output(unsigned char c, struct tty_struct *tty, bool nowait)
+{
+	struct n_tty_data *ldata = tty->disc_data;
+	int	space, retval;
+
+	if (n_tty_output_lock(ldata, nowait))
+		return -1;
+
+	space = tty_write_room(tty);
+	retval = do_output_char(c, tty, space); // 扩展后的字符 (如 \n -> \r\n, tab) 放不下时不写, 返回 -1
+
+	mutex_unlock(&ldata->output_lock);
+	if (retval < 0)
+		return -1;
+	else
+		return 0;
+}
+
+/**
+ *	process_output_block		-	block post processor
+ *	@tty: terminal device
+ *	@buf: character buffer
+ *	@nr: number of bytes to output
+ *	@nowait: IOCB_NOWAIT write, do not wait for output_lock
+ *
+ *	Output a block of characters with OPOST processing.
+ *	Returns the number of characters output.
+ *
+ *	This path is used to speed up block console writes, among other
+ *	things when processing blocks of output data. It handles only
+ *	the simple cases normally found and helps to generate blocks of
+ *	symbols for the console driver and thus improve performance.
+ *
+ *	Locking: output_lock to protect column state and space left
+ *		 (also, this is called from n_tty_write under the
+ *		  tty layer write lock)
+ */
+static ssize_t process_output_block(struct tty_struct *tty,
+				    const unsigned char *buf, unsigned int nr, bool nowait)
+{
+	struct n_tty_data *ldata = tty->disc_data;
+	int	space;
+	int	i;
+	const unsigned char *cp;
+
+	i = n_tty_output_lock(ldata, nowait);
+	if (i)
+		return i;
+
+	space = tty_write_room(tty);
+	if (space <= 0) {
+		mutex_unlock(&ldata->output_lock);
+		return space;
+	}
+	if (nr > space)
+		nr = space;
+
+	for (i = 0, cp = buf; i < nr; i++, cp++) {
+		unsigned char c = *cp;
+
+		switch (c) {
+		case '\n':
+			if (O_ONLRET(tty))
+				ldata->column = 0;
+			if (O_ONLCR(tty))
+				goto break_out;
+			ldata->canon_column = ldata->column;
+			break;
+		case '\r':
+			if (O_ONOCR(tty) && ldata->column == 0)
+				goto break_out;
+			if (O_OCRNL(tty))
+				goto break_out;
+			ldata->canon_column = ldata->column = 0;
+			break;
+		case '\t':
+			goto break_out;
+		case '\b':
+			if (ldata->column > 0)
+				ldata->column--;
+			break;
+		default:
+			if (!iscntrl(c)) {
+				if (O_OLCUC(tty))
+					goto break_out;
+				if (!is_continuation(c, tty))
+					ldata->column++;
+			}
+			break;
+		}
+	}
+break_out:
+	i = tty->ops->write(tty, buf, i);
+
+	mutex_unlock(&ldata->output_lock);
+	return i;
+}
+
+/**
+ *	n_tty_write		-	write function for tty
+ *	@tty: tty device
+ *	@file: file object
+ *	@iocb: kernel I/O control block
+ *	@buf: userspace buffer pointer
+ *	@nr: size of I/O
+ *
+ *	Write function of the terminal device.  This is serialized with
+ *	respect to other write callers but not to termios changes, reads
+ *	and other such events.  Since the receive code will echo characters,
+ *	thus calling driver write methods, the output_lock is used in
+ *	the output processing functions called here as well as in the
+ *	echo processing function to protect the column state and space
+ *	left in the buffer.
+ *
+ *	This code must be sure never to sleep through a hangup.
+ *
+ *	With IOCB_NOWAIT nothing here sleeps: termios_rwsem and output_lock
+ *	are trylocked, pending echoes (which need output_lock to be written
+ *	first) give -EAGAIN, and a full driver buffer ends the write with
+ *	what was accepted, or -EAGAIN if nothing was. Room is checked per
+ *	character as OPOST expands it, so nothing is written that does not
+ *	fit.
+ *
+ *	Locking: output_lock to protect column state and space left
+ *		 (note that the process_output*() functions take this
+ *		  lock themselves)
+ */
+static ssize_t n_tty_write(struct tty_struct *tty, struct file *file,
+			   struct kiocb *iocb, const unsigned char *buf, size_t nr)
+{
+	struct n_tty_data *ldata = tty->disc_data;
+	const unsigned char *b = buf;
+	DEFINE_WAIT_FUNC(wait, woken_wake_function);
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	int c;
+	ssize_t retval = 0;
+
+	/* Job control check -- must be done at start (POSIX.1 7.1.1.4). */
+	if (L_TOSTOP(tty) && file->f_op->write_iter != redirected_tty_write) {
+		retval = tty_check_change(tty);
+		if (retval)
+			return retval;
+	}
+
+	if (!nowait)
+		down_read(&tty->termios_rwsem);
+	else if (!down_read_trylock(&tty->termios_rwsem))
+		return -EAGAIN;
+
+	/* Write out any echoed characters that are still pending */
+	if (!nowait) {
+		process_echoes(tty);
+	} else if (ldata->echo_mark != ldata->echo_tail) { // 回显要先写出去, 它需要 output_lock, 交给可以睡眠的重试
+		up_read(&tty->termios_rwsem);
+		return -EAGAIN;
+	}
+
+	add_wait_queue(&tty->write_wait, &wait);
+	while (1) {
+		if (signal_pending(current)) {
+			retval = -ERESTARTSYS;
+			break;
+		}
+		if (tty_hung_up_p(file) || (tty->link && !tty->link->count)) {
+			retval = -EIO;
+			break;
+		}
+		if (O_OPOST(tty)) {
+			while (nr > 0) {
+				ssize_t num = process_output_block(tty, b, nr, nowait);
+				if (num < 0) {
+					if (num == -EAGAIN)
+						break;
+					retval = num;
+					goto break_out;
+				}
+				b += num;
+				nr -= num;
+				if (nr == 0)
+					break;
+				c = *b;
+				if (process_output(c, tty, nowait) < 0)
+					break;
+				b++; nr--;
+			}
+			if (tty->ops->flush_chars)
+				tty->ops->flush_chars(tty);
+		} else {
+			while (nr > 0) {
+				if (n_tty_output_lock(ldata, nowait))
+					break;
+				c = tty->ops->write(tty, b, nr);
+				mutex_unlock(&ldata->output_lock);
+				if (c < 0) {
+					retval = c;
+					goto break_out;
+				}
+				if (!c)
+					break;
+				b += c;
+				nr -= c;
+			}
+		}
+		if (!nr)
+			break;
+		if (tty_io_nonblock(tty, file) || nowait) { // io_uring 收到 -EAGAIN 后等 write_wait 上的 EPOLLOUT
+			retval = -EAGAIN;
+			break;
+		}
+		up_read(&tty->termios_rwsem);
+
+		wait_woken(&wait, TASK_INTERRUPTIBLE, MAX_SCHEDULE_TIMEOUT);
+
+		down_read(&tty->termios_rwsem);
+	}
+break_out:
+	remove_wait_queue(&tty->write_wait, &wait);
+	if (nr && tty->fasync)
+		set_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+	up_read(&tty->termios_rwsem);
+	return (b - buf) ? b - buf : retval;
+}
 }
 ------------------------------------------------------------------------------------------------------------------------------
 1、 其它函数 o{----------------------------------------------------------------------------------------------------------------
@@ -190,4 +770,76 @@ static void n_tty_set_termios(struct tty_struct *tty, struct ktermios *old)
 	wake_up_interruptible(&tty->write_wait);
 	wake_up_interruptible(&tty->read_wait);
 }
+
+static void __n_tty_wake_reader(struct tty_struct *tty)
+{
+	kill_fasync(&tty->fasync, SIGIO, POLL_IN);
+	wake_up_interruptible_poll(&tty->read_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+static enum hrtimer_restart n_tty_wake_timer(struct hrtimer *t)
+{
+	struct n_tty_data *ldata = container_of(t, struct n_tty_data, wake_timer);
+
+	__n_tty_wake_reader(ldata->tty); // 数据不够 wake_bytes, 但已经等了 wake_delay_us
+	return HRTIMER_NORESTART;
+}
+
+/**
+ *	n_tty_wake_reader	-	wake readers according to the wakeup policy
+ *	@tty: terminal
+ *
+ *	Without a policy (wake_bytes == 0) readers are woken for every batch
+ *	received, as before. With one, they are woken once wake_bytes are
+ *	readable, or wake_delay_us after the first byte that did not reach
+ *	the threshold, whichever comes first. In canonical mode only bytes of
+ *	completed lines count. This cuts a 1 Mbaud telemetry stream from a
+ *	wakeup every few bytes to one per threshold, while bounding latency.
+ *	Poll/epoll see the same wakeups, VMIN/VTIME still apply to read().
+ *
+ *	Called from n_tty_receive_buf_common() with termios_rwsem held for
+ *	reading.
+ */
+static void n_tty_wake_reader(struct tty_struct *tty)
+{
+	struct n_tty_data *ldata = tty->disc_data;
+	size_t avail;
+
+	avail = ldata->icanon ? ldata->canon_head - ldata->read_tail : read_cnt(ldata);
+	if (!avail)
+		return;
+
+	if (!ldata->wake_bytes || avail >= ldata->wake_bytes) {
+		hrtimer_try_to_cancel(&ldata->wake_timer);
+		__n_tty_wake_reader(tty);
+	} else if (!hrtimer_active(&ldata->wake_timer)) { // 第一批不够阈值的数据, 开始计时
+		hrtimer_start(&ldata->wake_timer, ns_to_ktime(ldata->wake_delay_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+	}
+}
+
+/**
+ *	n_tty_take_unread	-	remove unread input from read_buf
+ *	@tty: terminal
+ *	@buf: destination
+ *	@count: size of @buf
+ *
+ *	Copy up to @count bytes that were received but not yet read, oldest
+ *	first, and drop them from read_buf. Returns the number of bytes.
+ *
+ *	Called from tty_set_ldisc() with the ldisc locked for writing and
+ *	flush_to_ldisc() halted, just before this ldisc is closed.
+ */
+static int n_tty_take_unread(struct tty_struct *tty, unsigned char *buf, int count)
+{
+	struct n_tty_data *ldata = tty->disc_data;
+	size_t tail = ldata->read_tail & (N_TTY_BUF_SIZE - 1);
+	size_t n, first;
+
+	n = min_t(size_t, read_cnt(ldata), count);
+	first = min_t(size_t, n, N_TTY_BUF_SIZE - tail); // read_buf 是环形缓冲区, 最多分两段拷贝
+	memcpy(buf, read_buf_addr(ldata, tail), first);
+	memcpy(buf + first, read_buf_addr(ldata, 0), n - first);
+	ldata->read_tail += n;
+	return n;
+}
 ------------------------------------------------------------------------------------------------------------------------------
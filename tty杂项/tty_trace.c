@@ -0,0 +1,133 @@
+tty 数据路径上的静态 tracepoint, 对应 include/trace/events/tty.h.
+    一个 tty_buffer 从申请开始就带有 seq (tty_bufhead->seq 递增, 同一个端口上连续), 字节的位置用 (dev, seq, offset) 表示,
+offset 是字节在这个 tty_buffer 数据区中的下标. 各个事件记录的范围:
+    tty_flip_push       (seq, offset, count)    两次 push 之间发布的每个 tty_buffer 一个事件. tail 缓冲区是 [offset, offset + count);
+                                                中间已经写满封口的缓冲区可能已被 flush_to_ldisc() 释放, 拿不到长度, count = -1 表示到缓冲区末尾
+    tty_flush_to_ldisc  (seq, offset, count)    交给线路规程的 [head->read, head->read + count)
+    n_tty_receive       (seq, offset, head, end) 同一次 receive_buf 的来源位置, 以及这些字节在 read_buf 中占用的 [head, end),
+                                                head/end 是 read_head 计数 (不回绕, PARMRK 时一个字节可能占 3 个位置)
+    n_tty_read          (tail, end, count)      读进程从 read_buf 中取走 [tail, end), 拷贝给用户 count 字节
+用户空间按 (dev, seq, offset) 把 push/flush/receive 串起来, 再按 read_buf 区间的重叠把 receive 和 read 串起来, 就能得到每一批数据的延迟分解:
+    tty_insert_flip_*                       -> tty_flip_push        数据进入 tty_buffer, 到 push (驱动中断内)
+    tty_flip_push                           -> tty_flush_to_ldisc   工作队列调度延迟
+    tty_flush_to_ldisc                      -> n_tty_receive        线路规程处理时间
+    n_tty_receive                           -> n_tty_read           读进程被唤醒并拷贝数据的延迟
+    数据进入 tty_buffer 的时间没有事件, 驱动自己的 tracepoint 或 irq:irq_handler_entry 可以补上第一段.
+    tracepoint 关闭时只是一个 static key 跳过的 nop, 对数据路径几乎没有开销. 采集: perf record -e 'tty:*', 然后 perf script 输出给分析脚本.
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tty
+
+#if !defined(_TRACE_TTY_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_TTY_H
+
+#include <linux/tracepoint.h>
+#include <linux/tty.h>
+
+DECLARE_EVENT_CLASS(tty_buffer_span,
+
+	TP_PROTO(struct tty_port *port, u32 seq, int offset, int count),
+
+	TP_ARGS(port, seq, offset, count),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(u32,		seq)
+		__field(int,		offset)
+		__field(int,		count)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= port->itty ? tty_devnum(port->itty) : 0;
+		__entry->seq	= seq;
+		__entry->offset	= offset;
+		__entry->count	= count;
+	),
+
+	TP_printk("dev=%d:%d seq=%u off=%d count=%d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->seq, __entry->offset, __entry->count)
+);
+
+/*
+ * tty_flip_buffer_push(): one event per buffer published since the last
+ * push. count is -1 for buffers sealed in between: published up to their
+ * end, which may already be freed and cannot be looked at.
+ */
+DEFINE_EVENT(tty_buffer_span, tty_flip_push,
+	TP_PROTO(struct tty_port *port, u32 seq, int offset, int count),
+	TP_ARGS(port, seq, offset, count)
+);
+
+/* flush_to_ldisc() -> receive_buf(): bytes [offset, offset + count) handed to the ldisc */
+DEFINE_EVENT(tty_buffer_span, tty_flush_to_ldisc,
+	TP_PROTO(struct tty_port *port, u32 seq, int offset, int count),
+	TP_ARGS(port, seq, offset, count)
+);
+
+/*
+ * n_tty_receive_buf_common(): @rcvd bytes starting at (seq, offset), as
+ * noted by receive_buf() in tty_bufhead, went into read_buf positions
+ * [head, end). @avail is read_cnt afterwards.
+ */
+TRACE_EVENT(n_tty_receive,
+
+	TP_PROTO(struct tty_struct *tty, size_t head, size_t end, int rcvd, size_t avail),
+
+	TP_ARGS(tty, head, end, rcvd, avail),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(u32,		seq)
+		__field(int,		offset)
+		__field(size_t,		head)
+		__field(size_t,		end)
+		__field(int,		rcvd)
+		__field(size_t,		avail)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= tty_devnum(tty);
+		__entry->seq	= tty->port ? tty->port->buf.rx_seq : 0;
+		__entry->offset	= tty->port ? tty->port->buf.rx_off : 0;
+		__entry->head	= head;
+		__entry->end	= end;
+		__entry->rcvd	= rcvd;
+		__entry->avail	= avail;
+	),
+
+	TP_printk("dev=%d:%d seq=%u off=%d head=%zu end=%zu rcvd=%d avail=%zu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->seq, __entry->offset,
+		  __entry->head, __entry->end, __entry->rcvd, __entry->avail)
+);
+
+/* n_tty_read(): reader took read_buf positions [tail, end) and copied @count bytes to user */
+TRACE_EVENT(n_tty_read,
+
+	TP_PROTO(struct tty_struct *tty, size_t tail, size_t end, size_t count),
+
+	TP_ARGS(tty, tail, end, count),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(size_t,		tail)
+		__field(size_t,		end)
+		__field(size_t,		count)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= tty_devnum(tty);
+		__entry->tail	= tail;
+		__entry->end	= end;
+		__entry->count	= count;
+	),
+
+	TP_printk("dev=%d:%d tail=%zu end=%zu count=%zu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->tail, __entry->end, __entry->count)
+);
+
+#endif /* _TRACE_TTY_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -1,4 +1,8 @@
 EXPORT_SYMBOL(uart_update_timeout); // 更新 FIFO 超时时间
+EXPORT_SYMBOL_GPL(uart_set_rx_coalesce); // 设置 RX FIFO 触发水位、接收超时时间
+EXPORT_SYMBOL_GPL(uart_perf_irq_exit); // 统计中断处理时间
+EXPORT_SYMBOL_GPL(uart_perf_rx); // 统计接收字节数
+EXPORT_SYMBOL_GPL(uart_perf_tx); // 统计 PIO 发送字节数
 EXPORT_SYMBOL(uart_get_baud_rate); // 获取波特率
 EXPORT_SYMBOL(uart_get_divisor); // 获取时钟分频系数
 
@@ -15,32 +19,1349 @@ EXPORT_SYMBOL_GPL(uart_handle_cts_change);
 
 EXPORT_SYMBOL_GPL(uart_insert_char); // 提交一个字符
 EXPORT_SYMBOL(uart_write_wakeup); // 唤醒使用这个串口的程序，可以发送数据到循环缓冲区
+EXPORT_SYMBOL(uart_tx_wakeup_needed); // 代替驱动中的 uart_circ_chars_pending(xmit) < WAKEUP_CHARS 判断
+EXPORT_SYMBOL_GPL(uart_tx_empty_notify); // 发送器空中断, 唤醒 tcdrain()/close() 中的等待者
+EXPORT_SYMBOL_GPL(uart_dma_tx_start); // 用 DMA 发送循环缓冲区中的数据
+EXPORT_SYMBOL_GPL(uart_dma_tx_complete); // DMA 发送完成
+EXPORT_SYMBOL_GPL(uart_dma_rx_init); // 申请接收 DMA 的两个缓冲区并开始接收
+EXPORT_SYMBOL_GPL(uart_dma_rx_exit);
+EXPORT_SYMBOL_GPL(uart_dma_rx_complete); // 一个接收缓冲区满了
+EXPORT_SYMBOL_GPL(uart_dma_rx_idle); // 接收线路空闲超时
+EXPORT_SYMBOL_GPL(uart_set_burst_io); // 根据 iotype 选择批量读写 FIFO 的函数
+EXPORT_SYMBOL_GPL(uart_read_fifo); // 一次读取多个字节
+EXPORT_SYMBOL_GPL(uart_write_fifo); // 一次写入多个字节
 EXPORT_SYMBOL(uart_register_driver); // 注册一个 uart_driver
 EXPORT_SYMBOL(uart_unregister_driver); // 注销一个 uart_driver
 EXPORT_SYMBOL(uart_suspend_port);	// 暂停使用端口
 EXPORT_SYMBOL(uart_resume_port);	// 继续使用端口
 EXPORT_SYMBOL(uart_add_one_port); // 添加一个 uart_port
+EXPORT_SYMBOL(uart_add_ports); // 一次添加多个 uart_port
 EXPORT_SYMBOL(uart_remove_one_port); // 移除一个 uart_port
 
 
+/*
+ * The transmit ring used to be a fixed page (UART_XMIT_SIZE) and writers
+ * were woken every WAKEUP_CHARS bytes. Both are now per port: at high
+ * baud rates a bigger ring and a higher wakeup watermark let a writer
+ * queue more per write() and get woken far less often.
+ */
+#define UART_XMIT_SIZE_MAX	(1 << 20)
+
+/* One page rings kept per NUMA node by each uart_driver's xmit_pool */
+#define UART_XMIT_POOL_PAGES	8
+
+/*
+ * The ring must be physically contiguous: uart_dma_tx_start() maps it
+ * with sg_set_buf(), so no vmalloc memory. It is allocated on the node
+ * of the port's interrupt (port->node, see uart_port_node()). The
+ * default one page ring is recycled through the driver's xmit_pool, so
+ * a port that is opened and closed all the time does not go back to
+ * the page allocator each time.
+ */
+static unsigned char *uart_xmit_buf_alloc(struct uart_state *state, unsigned int size)
+{
+	struct tty_port *port = &state->port;
+	struct page *page;
+
+	if (size == PAGE_SIZE)
+		page = tty_xmit_pool_alloc_page(port->xmit_pool, port->node);
+	else
+		page = alloc_pages_node(port->node == NUMA_NO_NODE ? numa_node_id() : port->node,
+					GFP_KERNEL, get_order(size)); // 原来是 get_zeroed_page(GFP_KERNEL)
+	return page ? page_address(page) : NULL;
+}
+
+static void uart_xmit_buf_free(struct uart_state *state, unsigned char *buf, unsigned int size)
+{
+	if (!buf)
+		return;
+	if (size == PAGE_SIZE)
+		tty_xmit_pool_free_page(state->port.xmit_pool, virt_to_page(buf));
+	else
+		free_pages((unsigned long)buf, get_order(size));
+}
+
+/* Called from uart_port_startup() with the port mutex held */
+static int uart_alloc_xmit(struct uart_state *state)
+{
+	unsigned char *buf;
+
+	if (!state->xmit_size) { // 没有通过 sysfs 设置过, 使用原来的一页
+		state->xmit_size = UART_XMIT_SIZE;
+		state->wakeup_chars = WAKEUP_CHARS;
+	}
+	if (state->xmit.buf)
+		return 0;
+
+	buf = uart_xmit_buf_alloc(state, state->xmit_size);
+	if (!buf)
+		return -ENOMEM;
+
+	state->xmit.buf = buf;
+	uart_circ_clear(&state->xmit);
+	return 0;
+}
+
+/*
+ * Startup the port.  This will be called once per open.  All calls
+ * will be serialised by the per-port mutex.
+ */
+static int uart_port_startup(struct tty_struct *tty, struct uart_state *state,
+		int init_hw)
+{
+	struct uart_port *uport = uart_port_check(state);
+	int retval = 0;
+
+	if (uport->type == PORT_UNKNOWN)
+		return 1;
+
+	/*
+	 * Make sure the device is in D0 state.
+	 */
+	uart_change_pm(state, UART_PM_STATE_ON);
+
+	/*
+	 * Initialise and allocate the transmit and temporary
+	 * buffer.
+	 */
+	if (uart_alloc_xmit(state)) // 按 state->xmit_size 申请, 不再固定一页
+		return -ENOMEM;
+
+	retval = uport->ops->startup(uport);
+	if (retval == 0) {
+		if (uart_console(uport) && uport->cons->cflag) {
+			tty->termios.c_cflag = uport->cons->cflag;
+			uport->cons->cflag = 0;
+		}
+		/*
+		 * Initialise the hardware port settings.
+		 */
+		uart_change_speed(tty, state, NULL);
+
+		/*
+		 * Setup the RTS and DTR signals once the
+		 * port is open and ready to respond.
+		 */
+		if (init_hw && C_BAUD(tty))
+			uart_port_dtr_rts(uport, 1);
+	}
+
+	/*
+	 * This is to allow setserial on this port. People may want to set
+	 * port/irq/type and then reconfigure the port properly if it failed
+	 * now.
+	 */
+	if (retval && capable(CAP_SYS_ADMIN))
+		return 1;
+
+	return retval;
+}
+
+/*
+ * This routine will shutdown a serial port; interrupts are disabled, and
+ * DTR is dropped if the hangup on close termio flag is on.  Calls to
+ * uart_shutdown are serialised by the per-port semaphore.
+ *
+ * uport == NULL if uart_port has already been removed
+ */
+static void uart_shutdown(struct tty_struct *tty, struct uart_state *state)
+{
+	struct uart_port *uport = uart_port_check(state);
+	struct tty_port *port = &state->port;
+	unsigned long flags = 0;
+	unsigned char *xmit_buf = NULL;
+
+	/*
+	 * Set the TTY IO error marker
+	 */
+	if (tty)
+		set_bit(TTY_IO_ERROR, &tty->flags);
+
+	if (tty_port_initialized(port)) {
+		tty_port_set_initialized(port, 0);
+
+		/*
+		 * Turn off DTR and RTS early.
+		 */
+		if (uport && uart_console(uport) && tty)
+			uport->cons->cflag = tty->termios.c_cflag;
+
+		if (!tty || C_HUPCL(tty))
+			uart_port_dtr_rts(uport, 0);
+
+		uart_port_shutdown(port);
+	}
+
+	/*
+	 * It's possible for shutdown to be called after suspend if we get
+	 * a DCD drop (hangup) at just the right time.  Clear suspended bit so
+	 * we don't try to resume a port that has been shutdown.
+	 */
+	tty_port_set_suspended(port, 0);
+
+	/*
+	 * Do not free() the transmit buffer page under the port lock since
+	 * this can create various circular locking scenarios. For instance,
+	 * console driver may need to allocate/free a debug object, which
+	 * can endup in printk() recursion.
+	 */
+	uart_port_lock(state, flags);
+	xmit_buf = state->xmit.buf;
+	state->xmit.buf = NULL;
+	uart_port_unlock(uport, flags);
+
+	uart_xmit_buf_free(state, xmit_buf, state->xmit_size); // xmit_size 只在 port mutex 下修改, 和申请时一致
+}
+
+/*
+ * Whether a driver should call uart_write_wakeup() now. Replaces the
+ * open-coded uart_circ_chars_pending(xmit) < WAKEUP_CHARS test.
+ */
+bool uart_tx_wakeup_needed(struct uart_port *uport)
+{
+	struct uart_state *state = uport->state;
+
+	return uart_xmit_pending(state) < state->wakeup_chars;
+}
+
+static int uart_write_room(struct tty_struct *tty)
+{
+	struct uart_state *state = tty->driver_data;
+	struct uart_port *port;
+	unsigned long flags;
+	int ret;
+
+	port = uart_port_lock(state, flags);
+	ret = CIRC_SPACE(state->xmit.head, state->xmit.tail, state->xmit_size);
+	uart_port_unlock(port, flags);
+	return ret;
+}
+
+static int uart_write(struct tty_struct *tty, const unsigned char *buf, int count)
+{
+	struct uart_state *state = tty->driver_data;
+	struct uart_port *port;
+	struct circ_buf *circ;
+	unsigned long flags;
+	int c, ret = 0;
+
+	circ = &state->xmit;
+	if (!circ->buf)
+		return 0;
+
+	port = uart_port_lock(state, flags);
+	while (port) {
+		c = CIRC_SPACE_TO_END(circ->head, circ->tail, state->xmit_size);
+		if (count < c)
+			c = count;
+		if (c <= 0)
+			break;
+		memcpy(circ->buf + circ->head, buf, c);
+		circ->head = (circ->head + c) & (state->xmit_size - 1);
+		buf += c;
+		count -= c;
+		ret += c;
+	}
+
+	if (port)
+		uart_perf_tx_queued(port);
+	__uart_start(tty);
+	uart_port_unlock(port, flags);
+	return ret;
+}
+
+/**
+ *	uart_resize_xmit - change the size of a port's transmit ring
+ *	@state: port state
+ *	@size: new size in bytes, a power of two between UART_XMIT_SIZE and
+ *	       UART_XMIT_SIZE_MAX
+ *
+ *	May be called while the port is open. Pending data is copied into
+ *	the new ring; -EBUSY is returned if it would not fit or a DMA
+ *	transmit is in flight. The wakeup watermark is scaled to a quarter
+ *	of the ring, never below WAKEUP_CHARS.
+ *
+ *	Only ports whose driver sets uport->xmit_resizable can be resized:
+ *	most drivers still wrap xmit->tail with UART_XMIT_SIZE - 1 and
+ *	would walk off a bigger ring. Others get -EOPNOTSUPP.
+ *
+ *	Locking: takes the port mutex and the port lock
+ */
+static int uart_resize_xmit(struct uart_state *state, unsigned int size)
+{
+	struct tty_port *port = &state->port;
+	struct circ_buf *xmit = &state->xmit;
+	struct uart_port *uport;
+	unsigned char *buf, *old = NULL;
+	unsigned int old_size = size;
+	unsigned long flags;
+	unsigned int pending, first;
+	int ret = 0;
+
+	if (!is_power_of_2(size) || size < UART_XMIT_SIZE || size > UART_XMIT_SIZE_MAX)
+		return -EINVAL;
+
+	buf = uart_xmit_buf_alloc(state, size);
+	if (!buf)
+		return -ENOMEM;
+
+	mutex_lock(&port->mutex);
+	uport = uart_port_lock(state, flags);
+	if (!uport || !uport->xmit_resizable) { // 驱动还在用 UART_XMIT_SIZE - 1 回绕 tail
+		old = buf;
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+	if (!xmit->buf) { // 端口还没有打开, 下次 uart_alloc_xmit() 按新的大小申请
+		old = buf;
+		goto out;
+	}
+
+	pending = uart_xmit_pending(state);
+	if (pending >= size || state->tx_dma_len) {
+		old = buf;
+		ret = -EBUSY;
+		goto out;
+	}
+
+	first = min(pending, CIRC_CNT_TO_END(xmit->head, xmit->tail, state->xmit_size)); // 把未发送的数据按顺序拷贝到新缓冲区开头
+	memcpy(buf, xmit->buf + xmit->tail, first);
+	memcpy(buf + first, xmit->buf, pending - first);
+
+	old = xmit->buf;
+	old_size = state->xmit_size;
+	xmit->buf = buf;
+	xmit->tail = 0;
+	xmit->head = pending;
+out:
+	if (!ret) {
+		state->xmit_size = size;
+		state->wakeup_chars = max_t(unsigned int, size / 4, WAKEUP_CHARS);
+	}
+	uart_port_unlock(uport, flags);
+	mutex_unlock(&port->mutex);
+
+	uart_xmit_buf_free(state, old, old_size);
+	return ret;
+}
+
+static ssize_t uart_get_attr_xmit_size(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tty_port *port = dev_get_drvdata(dev);
+	struct uart_state *state = container_of(port, struct uart_state, port);
+
+	return sprintf(buf, "%u\n", state->xmit_size ? : UART_XMIT_SIZE);
+}
+
+static ssize_t uart_set_attr_xmit_size(struct device *dev, struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct tty_port *port = dev_get_drvdata(dev);
+	struct uart_state *state = container_of(port, struct uart_state, port);
+	unsigned int size;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &size);
+	if (ret)
+		return ret;
+
+	ret = uart_resize_xmit(state, size);
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR(xmit_size, S_IRUSR | S_IWUSR | S_IRGRP, uart_get_attr_xmit_size, uart_set_attr_xmit_size); // /sys/class/tty/ttyXXX/xmit_size
+
+/*
+ * Performance counters. Drivers bracket their interrupt handler with
+ *
+ *	u64 t = ktime_get_ns();
+ *	...
+ *	uart_perf_irq_exit(port, t);
+ *
+ * and serial core accounts bytes itself where it moves them. Updates
+ * only touch this cpu's counters or, for the high-water marks, a plain
+ * word that is written only when the mark rises.
+ */
+void uart_perf_irq_exit(struct uart_port *uport, u64 start)
+{
+	u64 delta = ktime_get_ns() - start;
+	int bucket = min_t(int, fls64(delta >> 8), UART_PERF_IRQ_BUCKETS - 1);
+
+	if (!uport->perf)
+		return;
+	this_cpu_inc(uport->perf->irqs);
+	this_cpu_inc(uport->perf->irq_hist[bucket]);
+}
+
+/*
+ * PIO transmit, for drivers that feed the TX FIFO byte by byte from their
+ * interrupt handler. uart_write_fifo() already counts what it writes.
+ */
+void uart_perf_tx(struct uart_port *uport, unsigned int count)
+{
+	if (uport->perf)
+		this_cpu_add(uport->perf->tx_bytes, count);
+}
+
+void uart_perf_rx(struct uart_port *uport, unsigned int count)
+{
+	struct tty_port *tport = &uport->state->port;
+	u32 used = atomic_read(&tport->buf.mem_used); // flip 缓冲区当前占用
+
+	if (uport->perf)
+		this_cpu_add(uport->perf->rx_bytes, count);
+	if (used > READ_ONCE(uport->flip_hwm))
+		WRITE_ONCE(uport->flip_hwm, used);
+}
+
+static void uart_perf_tx_queued(struct uart_port *uport)
+{
+	u32 pending = uart_xmit_pending(uport->state);
+
+	if (pending > READ_ONCE(uport->tx_ring_hwm))
+		WRITE_ONCE(uport->tx_ring_hwm, pending);
+}
+
+/* Called from uart_throttle()/uart_unthrottle() with the tty throttle_mutex held */
+static void uart_perf_throttle(struct uart_port *uport, bool throttle)
+{
+	u64 now = ktime_get_ns();
+
+	if (throttle && !uport->throttle_start) {
+		uport->throttle_start = now;
+	} else if (!throttle && uport->throttle_start) {
+		uport->throttled_ns += now - uport->throttle_start;
+		uport->throttle_start = 0;
+	}
+}
+
+static ssize_t uart_perf_read(struct file *file, char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct uart_port *uport = file->private_data;
+	struct uart_perf perf = {};
+	int cpu, i;
+
+	perf.timestamp_ns = ktime_get_ns();
+	if (uport->perf) {
+		for_each_possible_cpu(cpu) { // 读的时候才把各个 cpu 的计数加起来
+			struct uart_perf_pcpu *p = per_cpu_ptr(uport->perf, cpu);
+
+			perf.rx_bytes += p->rx_bytes;
+			perf.tx_bytes += p->tx_bytes;
+			perf.irqs += p->irqs;
+			for (i = 0; i < UART_PERF_IRQ_BUCKETS; i++)
+				perf.irq_hist[i] += p->irq_hist[i];
+		}
+	}
+	perf.throttled_ns = uport->throttled_ns;
+	if (uport->throttle_start)
+		perf.throttled_ns += perf.timestamp_ns - uport->throttle_start;
+	perf.flip_hwm = READ_ONCE(uport->flip_hwm);
+	perf.tx_ring_hwm = READ_ONCE(uport->tx_ring_hwm);
+
+	return simple_read_from_buffer(ubuf, count, ppos, &perf, sizeof(perf));
+}
+
+static const struct file_operations uart_perf_fops = {
+	.owner	= THIS_MODULE,
+	.open	= simple_open,
+	.read	= uart_perf_read,
+	.llseek	= default_llseek,
+};
+
+static struct dentry *uart_debugfs_root; // /sys/kernel/debug/serial, 在 serial core 初始化时创建
+
+/* /sys/kernel/debug/serial/<ttyname>/perf */
+static void uart_perf_add(struct uart_port *uport, struct device *tty_dev)
+{
+	struct dentry *dir;
+
+	uport->perf = alloc_percpu(struct uart_perf_pcpu);
+	if (!uport->perf) // 统计不是必须的, 申请失败也不影响端口工作
+		return;
+
+	dir = debugfs_create_dir(dev_name(tty_dev), uart_debugfs_root);
+	debugfs_create_file("perf", 0400, dir, uport, &uart_perf_fops);
+	uport->perf_dir = dir;
+}
+
+/* Called from uart_remove_one_port() once the port is detached */
+static void uart_perf_remove(struct uart_port *uport)
+{
+	debugfs_remove_recursive(uport->perf_dir); // 等待正在进行的 uart_perf_read() 结束
+	uport->perf_dir = NULL;
+	free_percpu(uport->perf);
+	uport->perf = NULL;
+}
+
+static int __init uart_debugfs_init(void)
+{
+	uart_debugfs_root = debugfs_create_dir("serial", NULL);
+	return 0;
+}
+subsys_initcall(uart_debugfs_init); // 要在串口驱动注册端口之前
+
+static void __exit uart_debugfs_exit(void)
+{
+	debugfs_remove_recursive(uart_debugfs_root);
+}
+module_exit(uart_debugfs_exit);
+
+/*
+ * Throttle / unthrottle, called by the line discipline with the tty
+ * throttle_mutex held.
+ */
+static void uart_throttle(struct tty_struct *tty)
+{
+	struct uart_state *state = tty->driver_data;
+	upstat_t mask = UPSTAT_SYNC_FIFO;
+	struct uart_port *port;
+
+	port = uart_port_ref(state);
+	if (!port)
+		return;
+
+	uart_perf_throttle(port, true); // 开始计算被节流的时间
+
+	if (I_IXOFF(tty))
+		mask |= UPSTAT_AUTOXOFF;
+	if (C_CRTSCTS(tty))
+		mask |= UPSTAT_AUTORTS;
+
+	if (port->status & mask) {
+		port->ops->throttle(port);
+		mask &= ~port->status;
+	}
+
+	if (mask & UPSTAT_AUTORTS)
+		uart_clear_mctrl(port, TIOCM_RTS);
+
+	if (mask & UPSTAT_AUTOXOFF)
+		uart_send_xchar(tty, STOP_CHAR(tty));
+
+	uart_port_deref(port);
+}
+
+static void uart_unthrottle(struct tty_struct *tty)
+{
+	struct uart_state *state = tty->driver_data;
+	upstat_t mask = UPSTAT_SYNC_FIFO;
+	struct uart_port *port;
+
+	port = uart_port_ref(state);
+	if (!port)
+		return;
+
+	if (I_IXOFF(tty))
+		mask |= UPSTAT_AUTOXOFF;
+	if (C_CRTSCTS(tty))
+		mask |= UPSTAT_AUTORTS;
+
+	if (port->status & mask) {
+		port->ops->unthrottle(port);
+		mask &= ~port->status;
+	}
+
+	if (mask & UPSTAT_AUTORTS)
+		uart_set_mctrl(port, TIOCM_RTS);
+
+	if (mask & UPSTAT_AUTOXOFF)
+		uart_send_xchar(tty, START_CHAR(tty));
+
+	uart_perf_throttle(port, false); // 累加到 throttled_ns
+
+	uart_port_deref(port);
+}
+
+/**
+ *	uart_set_rx_coalesce - trade RX interrupt rate against latency
+ *	@uport: uart port
+ *	@baud: current baud rate, used to turn max_irq_rate into a trigger
+ *	@c: requested settings, updated with what the driver programmed
+ *
+ *	If only max_irq_rate is given, the trigger level is derived from
+ *	the character rate (10 bits per character) and clamped to fifosize.
+ *	A telemetry port can then take one interrupt per FIFO fill while a
+ *	control port keeps trigger 1 for the lowest latency.
+ *
+ *	Locking: caller holds the port mutex
+ */
+int uart_set_rx_coalesce(struct uart_port *uport, unsigned int baud, struct serial_rx_coalesce *c)
+{
+	int ret;
+
+	if (!uport->ops->set_rx_coalesce)
+		return -EOPNOTSUPP;
+
+	if (c->rx_trigger > uport->fifosize)
+		return -EINVAL;
+
+	if (!c->rx_trigger && c->max_irq_rate && baud) { // 每秒字符数 / 目标中断频率 = 每次中断需要攒够的字节数
+		c->rx_trigger = DIV_ROUND_UP(baud / 10, c->max_irq_rate);
+		c->rx_trigger = clamp_t(u32, c->rx_trigger, 1, uport->fifosize);
+	}
+
+	ret = uport->ops->set_rx_coalesce(uport, c); // 驱动按硬件支持的档位取整后回写 c
+	if (!ret)
+		uport->rx_coalesce = *c;
+	return ret;
+}
+
+/* TIOCGRXCOAL / TIOCSRXCOAL, called from uart_ioctl() */
+static int uart_rx_coalesce_ioctl(struct tty_struct *tty, struct uart_state *state,
+				  unsigned int cmd, void __user *argp)
+{
+	struct tty_port *port = &state->port;
+	struct serial_rx_coalesce c;
+	struct uart_port *uport;
+	int ret = 0;
+
+	if (cmd == TIOCSRXCOAL && copy_from_user(&c, argp, sizeof(c)))
+		return -EFAULT;
+
+	mutex_lock(&port->mutex);
+	uport = uart_port_check(state);
+	if (!uport) {
+		ret = -EIO;
+		goto out;
+	}
+
+	if (cmd == TIOCSRXCOAL)
+		ret = uart_set_rx_coalesce(uport, tty_get_baud_rate(tty), &c);
+	else
+		c = uport->rx_coalesce;
+out:
+	mutex_unlock(&port->mutex);
+
+	if (!ret && copy_to_user(argp, &c, sizeof(c))) // 把驱动实际设置的值返回给用户
+		ret = -EFAULT;
+	return ret;
+}
+
+/*
+ * Called via sys_ioctl.  We can use spin_lock_irq() here.
+ */
+static int
+uart_ioctl(struct tty_struct *tty, unsigned int cmd, unsigned long arg)
+{
+	struct uart_state *state = tty->driver_data;
+	struct tty_port *port = &state->port;
+	struct uart_port *uport;
+	void __user *uarg = (void __user *)arg;
+	int ret = -ENOIOCTLCMD;
+
+	/*
+	 * These ioctls don't rely on the hardware to be present.
+	 */
+	switch (cmd) {
+	case TIOCSERCONFIG:
+		down_write(&tty->termios_rwsem);
+		ret = uart_do_autoconfig(tty, state);
+		up_write(&tty->termios_rwsem);
+		break;
+	}
+
+	if (ret != -ENOIOCTLCMD)
+		goto out;
+
+	if (tty_io_error(tty)) {
+		ret = -EIO;
+		goto out;
+	}
+
+	/*
+	 * The following should only be used when hardware is present.
+	 */
+	switch (cmd) {
+	case TIOCMIWAIT:
+		ret = uart_wait_modem_status(state, arg);
+		break;
+
+	case TIOCGRXCOAL:
+	case TIOCSRXCOAL: // 自己拿 port->mutex, 所以放在这里
+		ret = uart_rx_coalesce_ioctl(tty, state, cmd, uarg);
+		break;
+	}
+
+	if (ret != -ENOIOCTLCMD)
+		goto out;
+
+	/* rs485_config requires more locking than others */
+	if (cmd == TIOCSRS485)
+		down_write(&tty->termios_rwsem);
+
+	mutex_lock(&port->mutex);
+	uport = uart_port_check(state);
+
+	if (!uport || tty_io_error(tty)) {
+		ret = -EIO;
+		goto out_up;
+	}
+
+	/*
+	 * All these rely on hardware being present and need to be
+	 * protected against the tty being hung up.
+	 */
+
+	switch (cmd) {
+	case TIOCSERGETLSR: /* Get line status register */
+		ret = uart_get_lsr_info(tty, state, uarg);
+		break;
+
+	case TIOCGRS485:
+		ret = uart_get_rs485_config(uport, uarg);
+		break;
+
+	case TIOCSRS485:
+		ret = uart_set_rs485_config(uport, uarg);
+		break;
+
+	case TIOCSISO7816:
+		ret = uart_set_iso7816_config(state->uart_port, uarg);
+		break;
+
+	case TIOCGISO7816:
+		ret = uart_get_iso7816_config(state->uart_port, uarg);
+		break;
+	default:
+		if (uport->ops->ioctl)
+			ret = uport->ops->ioctl(uport, cmd, arg);
+		break;
+	}
+out_up:
+	mutex_unlock(&port->mutex);
+	if (cmd == TIOCSRS485)
+		up_write(&tty->termios_rwsem);
+out:
+	return ret;
+}
+
+static ssize_t uart_get_attr_rx_coalesce(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tty_port *port = dev_get_drvdata(dev);
+	struct uart_state *state = container_of(port, struct uart_state, port);
+	struct serial_rx_coalesce c = {};
+
+	mutex_lock(&port->mutex);
+	if (uart_port_check(state))
+		c = state->uart_port->rx_coalesce;
+	mutex_unlock(&port->mutex);
+
+	return sprintf(buf, "%u %u %u\n", c.rx_trigger, c.rx_timeout_us, c.max_irq_rate);
+}
+
+/* "<rx_trigger> <rx_timeout_us> <max_irq_rate>" */
+static ssize_t uart_set_attr_rx_coalesce(struct device *dev, struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct tty_port *port = dev_get_drvdata(dev);
+	struct uart_state *state = container_of(port, struct uart_state, port);
+	struct serial_rx_coalesce c;
+	struct uart_port *uport;
+	struct tty_struct *tty;
+	int ret = -EIO;
+
+	if (sscanf(buf, "%u %u %u", &c.rx_trigger, &c.rx_timeout_us, &c.max_irq_rate) != 3)
+		return -EINVAL;
+
+	tty = tty_port_tty_get(port);
+	mutex_lock(&port->mutex);
+	uport = uart_port_check(state);
+	if (uport)
+		ret = uart_set_rx_coalesce(uport, tty ? tty_get_baud_rate(tty) : 0, &c);
+	mutex_unlock(&port->mutex);
+	tty_kref_put(tty);
+
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR(rx_coalesce, S_IRUSR | S_IWUSR | S_IRGRP, uart_get_attr_rx_coalesce, uart_set_attr_rx_coalesce);
+
+static const char * const uart_flush_modes[] = {
+	[TTY_FLUSH_UNBOUND]	= "unbound",
+	[TTY_FLUSH_IRQ]		= "irq",
+	[TTY_FLUSH_READER]	= "reader",
+};
+
+static ssize_t uart_get_attr_flush_affinity(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tty_port *port = dev_get_drvdata(dev);
+	int mode = READ_ONCE(port->buf.flush_mode);
+
+	if (mode == TTY_FLUSH_CPU)
+		return sprintf(buf, "%d\n", READ_ONCE(port->buf.flush_cpu));
+	return sprintf(buf, "%s\n", uart_flush_modes[mode]);
+}
+
+/* "unbound", "irq", "reader" or a cpu number */
+static ssize_t uart_set_attr_flush_affinity(struct device *dev, struct device_attribute *attr,
+					    const char *buf, size_t count)
+{
+	struct tty_port *port = dev_get_drvdata(dev);
+	int mode, cpu = -1;
+	int ret;
+
+	mode = sysfs_match_string(uart_flush_modes, buf);
+	if (mode < 0) {
+		ret = kstrtoint(buf, 0, &cpu);
+		if (ret)
+			return ret;
+		mode = TTY_FLUSH_CPU;
+	}
+
+	ret = tty_buffer_set_flush_affinity(port, mode, cpu);
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR(flush_affinity, S_IRUSR | S_IWUSR | S_IRGRP, uart_get_attr_flush_affinity, uart_set_attr_flush_affinity); // /sys/class/tty/ttyXXX/flush_affinity
+
+static struct attribute *tty_dev_attrs[] = {
+	&dev_attr_type.attr,
+	&dev_attr_line.attr,
+	&dev_attr_port.attr,
+	&dev_attr_irq.attr,
+	&dev_attr_flags.attr,
+	&dev_attr_xmit_fifo_size.attr,
+	&dev_attr_uartclk.attr,
+	&dev_attr_close_delay.attr,
+	&dev_attr_closing_wait.attr,
+	&dev_attr_custom_divisor.attr,
+	&dev_attr_io_type.attr,
+	&dev_attr_iomem_base.attr,
+	&dev_attr_iomem_reg_shift.attr,
+	&dev_attr_console.attr,
+	&dev_attr_xmit_size.attr,
+	&dev_attr_rx_coalesce.attr,
+	&dev_attr_flush_affinity.attr,
+	NULL,
+	};
+
+static const struct attribute_group tty_dev_attr_group = { // __uart_add_one_port() 中作为 uport->tty_groups[0]
+	.attrs = tty_dev_attrs,
+	};
+
+/**
+ *	uart_tx_empty_notify - the transmitter has drained
+ *	@uport: uart port
+ *
+ *	Called by drivers from their TEMT interrupt, see uart_ops->tx_empty_irq.
+ */
+void uart_tx_empty_notify(struct uart_port *uport)
+{
+	wake_up_interruptible(&uport->state->tx_empty_wait);
+}
+
+/*
+ * Drain by event: arm the driver's TX-empty interrupt and sleep until it
+ * fires, instead of polling tx_empty() every 1/5 character time. Returns
+ * as soon as the FIFO is empty, without sleeping if it already is.
+ */
+static void uart_wait_tx_empty_event(struct uart_port *port, struct uart_state *state, unsigned long timeout)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->lock, flags);
+	port->ops->tx_empty_irq(port, 1);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	wait_event_interruptible_timeout(state->tx_empty_wait, port->ops->tx_empty(port), timeout);
+
+	spin_lock_irqsave(&port->lock, flags);
+	port->ops->tx_empty_irq(port, 0);
+	spin_unlock_irqrestore(&port->lock, flags);
+}
+
+/*
+ * uart_wait_until_sent() is called from tty_wait_until_sent() for
+ * tcdrain() and from tty_port_close_start() on close.
+ */
+static void uart_wait_until_sent(struct tty_struct *tty, int timeout)
+{
+	struct uart_state *state = tty->driver_data;
+	struct uart_port *port;
+	unsigned long char_time, expire;
+
+	port = uart_port_ref(state);
+	if (!port)
+		return;
+
+	if (port->type == PORT_UNKNOWN || port->fifosize == 0) {
+		uart_port_deref(port);
+		return;
+	}
+
+	if (port->ops->tx_empty(port)) { // FIFO 已经空了, 直接返回
+		uart_port_deref(port);
+		return;
+	}
+
+	/*
+	 * If the transmitter hasn't cleared in twice the approximate
+	 * amount of time to send the entire FIFO, it probably won't
+	 * ever clear.  This assumes the UART isn't doing flow
+	 * control, which is currently the case.  Hence, if it ever
+	 * takes longer than port->timeout, this is probably due to a
+	 * UART bug of some kind.  So, we clamp the timeout parameter at
+	 * 2*port->timeout.
+	 */
+	if (timeout == 0 || timeout > 2 * port->timeout)
+		timeout = 2 * port->timeout;
+
+	if (port->ops->tx_empty_irq) { // 驱动支持发送器空中断, 最后一位发出去时立即被唤醒
+		uart_wait_tx_empty_event(port, state, timeout);
+		uart_port_deref(port);
+		return;
+	}
+
+	/*
+	 * Set the check interval to be 1/5 of the estimated time to
+	 * send a single character, and make it at least 1.  The check
+	 * interval should also be less than the timeout.
+	 *
+	 * Note: we have to use pretty tight timings here to satisfy
+	 * the NIST-PCTS.
+	 */
+	char_time = (port->timeout - HZ/50) / port->fifosize;
+	char_time = char_time / 5;
+	if (char_time == 0)
+		char_time = 1;
+	if (char_time > timeout)
+		char_time = timeout;
+
+	expire = jiffies + timeout;
+
+	/*
+	 * Check whether the transmitter is empty every 'char_time'.
+	 * 'timeout' / 'expire' give us the maximum amount of time
+	 * we wait.
+	 */
+	while (!port->ops->tx_empty(port)) {
+		msleep_interruptible(jiffies_to_msecs(char_time));
+		if (signal_pending(current))
+			break;
+		if (time_after(jiffies, expire))
+			break;
+	}
+	uart_port_deref(port);
+}
+
+/**
+ *	uart_dma_tx_start - hand the pending part of the xmit ring to DMA
+ *	@uport: uart port with a dma_tx_submit operation
+ *
+ *	Meant to be called from a driver's start_tx() instead of feeding
+ *	the FIFO with serial_out() one byte at a time. The pending bytes of
+ *	state->xmit are described by at most two scatterlist entries, split
+ *	where the data wraps around the end of the ring, and passed to
+ *	ops->dma_tx_submit(). Only one transfer is in flight per port; the
+ *	next one is started by uart_dma_tx_complete().
+ *
+ *	Locking: caller holds uport->lock
+ */
+int uart_dma_tx_start(struct uart_port *uport)
+{
+	struct uart_state *state = uport->state;
+	struct circ_buf *xmit = &state->xmit;
+	unsigned int len, first;
+	int nents = 1;
+	int ret;
+
+	if (state->tx_dma_len) // 上一次提交的 DMA 还没有完成
+		return 0;
+	if (uart_circ_empty(xmit) || uart_tx_stopped(uport))
+		return 0;
+
+	len = uart_xmit_pending(state);
+	first = CIRC_CNT_TO_END(xmit->head, xmit->tail, state->xmit_size); // tail 到缓冲区末尾的连续数据
+
+	sg_init_table(state->tx_sg, ARRAY_SIZE(state->tx_sg));
+	sg_set_buf(&state->tx_sg[0], xmit->buf + xmit->tail, first);
+	if (len > first) { // 数据跨过了缓冲区末尾, 第二段从 buf 开头开始
+		sg_set_buf(&state->tx_sg[1], xmit->buf, len - first);
+		nents = 2;
+	}
+	sg_mark_end(&state->tx_sg[nents - 1]);
+
+	state->tx_dma_len = len;
+	ret = uport->ops->dma_tx_submit(uport, state->tx_sg, nents);
+	if (ret)
+		state->tx_dma_len = 0; // 提交失败, 驱动可以退回 PIO 方式
+	return ret;
+}
+
+/**
+ *	uart_dma_tx_complete - account a finished DMA transmit
+ *	@uport: uart port
+ *	@sent: bytes actually transmitted, may be less than submitted if the
+ *	       transfer was terminated
+ *
+ *	Called by the driver from its DMA completion callback. Advances
+ *	xmit->tail, wakes up writers and starts the next transfer if more
+ *	data was queued meanwhile.
+ */
+void uart_dma_tx_complete(struct uart_port *uport, unsigned int sent)
+{
+	struct uart_state *state = uport->state;
+	unsigned long flags;
+
+	spin_lock_irqsave(&uport->lock, flags);
+	uart_xmit_consume(state, sent);
+	uport->icount.tx += sent;
+	if (uport->perf)
+		this_cpu_add(uport->perf->tx_bytes, sent);
+	state->tx_dma_len = 0;
+
+	if (uart_tx_wakeup_needed(uport))
+		uart_write_wakeup(uport);
+
+	uart_dma_tx_start(uport); // 传输期间 uart_write() 又放入了数据, 继续提交
+	spin_unlock_irqrestore(&uport->lock, flags);
+}
+
+/*
+ * Push a run of received bytes into the flip buffers in one go. Unlike
+ * uart_insert_char() there is no per-byte flag, so the tty_buffer keeps
+ * TTYB_NORMAL and receive_buf() passes no flag array to the ldisc.
+ * Errors are reported by the driver through uart_insert_char() as before.
+ */
+static void uart_dma_rx_push(struct uart_port *uport, unsigned char *p, unsigned int count)
+{
+	struct tty_port *tport = &uport->state->port;
+	int copied;
+
+	if (!count)
+		return;
+
+	copied = tty_insert_flip_string(tport, p, count); // 一次拷贝一段, 而不是逐字节 uart_insert_char()
+	uport->icount.rx += copied;
+	uart_perf_rx(uport, copied);
+	if (copied < count)
+		uport->icount.buf_overrun += count - copied; // flip 缓冲区达到 mem_limit
+	tty_flip_buffer_push(tport);
+}
+
+/**
+ *	uart_dma_rx_init - set up ping-pong receive DMA for a port
+ *	@uport: uart port with a dma_rx_start operation
+ *	@len: size of each of the two buffers
+ *
+ *	Usually called from the driver's startup().
+ */
+int uart_dma_rx_init(struct uart_port *uport, unsigned int len)
+{
+	struct uart_dma_rx *rx = &uport->state->rx_dma;
+	unsigned long flags;
+	int ret;
+
+	rx->buf[0] = kmalloc(len, GFP_KERNEL);
+	rx->buf[1] = kmalloc(len, GFP_KERNEL);
+	if (!rx->buf[0] || !rx->buf[1]) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	rx->len = len;
+	rx->cur = 0;
+	rx->pushed = 0;
+
+	spin_lock_irqsave(&uport->lock, flags);
+	ret = uport->ops->dma_rx_start(uport, rx->buf[0], len);
+	spin_unlock_irqrestore(&uport->lock, flags);
+	if (!ret)
+		return 0;
+err:
+	uart_dma_rx_exit(uport);
+	return ret;
+}
+
+/* Called from shutdown() once the driver has stopped its DMA channel */
+void uart_dma_rx_exit(struct uart_port *uport)
+{
+	struct uart_dma_rx *rx = &uport->state->rx_dma;
+
+	kfree(rx->buf[0]);
+	kfree(rx->buf[1]);
+	rx->buf[0] = rx->buf[1] = NULL;
+}
+
+/**
+ *	uart_dma_rx_complete - a receive buffer has been filled
+ *	@uport: uart port
+ *
+ *	Restart DMA on the other buffer first, so no data is lost while the
+ *	full one is pushed to the tty layer.
+ *
+ *	Locking: caller holds uport->lock
+ */
+void uart_dma_rx_complete(struct uart_port *uport)
+{
+	struct uart_dma_rx *rx = &uport->state->rx_dma;
+	unsigned int done = rx->cur;
+	unsigned int pushed = rx->pushed;
+
+	rx->cur ^= 1; // 先切换到另一个缓冲区继续接收
+	rx->pushed = 0;
+	if (uport->ops->dma_rx_start(uport, rx->buf[rx->cur], rx->len))
+		dev_warn_ratelimited(uport->dev, "rx dma restart failed\n");
+
+	uart_dma_rx_push(uport, rx->buf[done] + pushed, rx->len - pushed); // 再把填满的缓冲区中还没推送的部分推上去
+}
+
+/**
+ *	uart_dma_rx_idle - the receive line went idle
+ *	@uport: uart port
+ *	@filled: bytes the hardware has written into the current buffer
+ *
+ *	Called on an idle-line or receive-timeout interrupt, when the buffer
+ *	is not full but the sender has paused. Pushes what has arrived so
+ *	far and keeps the transfer running.
+ *
+ *	Locking: caller holds uport->lock
+ */
+void uart_dma_rx_idle(struct uart_port *uport, unsigned int filled)
+{
+	struct uart_dma_rx *rx = &uport->state->rx_dma;
+
+	if (filled <= rx->pushed)
+		return;
+
+	uart_dma_rx_push(uport, rx->buf[rx->cur] + rx->pushed, filled - rx->pushed);
+	rx->pushed = filled;
+}
+
+/*
+ * String I/O accessors for the FIFO data register, one set per iotype.
+ * The 32-bit variants read whole words with ioread32_rep() (native byte
+ * order) through a small bounce buffer and keep the low byte of each.
+ */
+#define UART_BURST_CHUNK	64
+
+static void uart_port_in_burst(struct uart_port *p, int offset, unsigned char *buf, unsigned int count)
+{
+	insb(p->iobase + (offset << p->regshift), buf, count); // 和 io_serial_in() 一样要考虑 regshift
+}
+
+static void uart_port_out_burst(struct uart_port *p, int offset, const unsigned char *buf, unsigned int count)
+{
+	outsb(p->iobase + (offset << p->regshift), buf, count);
+}
+
+static void uart_mem_in_burst(struct uart_port *p, int offset, unsigned char *buf, unsigned int count)
+{
+	readsb(p->membase + (offset << p->regshift), buf, count);
+}
+
+static void uart_mem_out_burst(struct uart_port *p, int offset, const unsigned char *buf, unsigned int count)
+{
+	writesb(p->membase + (offset << p->regshift), buf, count);
+}
+
+#define UART_MEM32_BURST(name, type, to_cpu, from_cpu)					\
+static void uart_##name##_in_burst(struct uart_port *p, int offset,			\
+				   unsigned char *buf, unsigned int count)		\
+{											\
+	void __iomem *addr = p->membase + (offset << p->regshift);			\
+	u32 tmp[UART_BURST_CHUNK];							\
+	unsigned int i, n;								\
+											\
+	while (count) {									\
+		n = min_t(unsigned int, count, UART_BURST_CHUNK);			\
+		ioread32_rep(addr, tmp, n);						\
+		for (i = 0; i < n; i++)							\
+			*buf++ = to_cpu((__force type)tmp[i]);				\
+		count -= n;								\
+	}										\
+}											\
+											\
+static void uart_##name##_out_burst(struct uart_port *p, int offset,			\
+				    const unsigned char *buf, unsigned int count)	\
+{											\
+	void __iomem *addr = p->membase + (offset << p->regshift);			\
+	u32 tmp[UART_BURST_CHUNK];							\
+	unsigned int i, n;								\
+											\
+	while (count) {									\
+		n = min_t(unsigned int, count, UART_BURST_CHUNK);			\
+		for (i = 0; i < n; i++)							\
+			tmp[i] = (__force u32)from_cpu(*buf++);				\
+		iowrite32_rep(addr, tmp, n);						\
+		count -= n;								\
+	}										\
+}
+
+UART_MEM32_BURST(mem32, __le32, le32_to_cpu, cpu_to_le32)	/* UPIO_MEM32 */
+UART_MEM32_BURST(mem32be, __be32, be32_to_cpu, cpu_to_be32)	/* UPIO_MEM32BE */
+
+/**
+ *	uart_set_burst_io - pick FIFO burst accessors for a port's iotype
+ *	@p: uart port
+ *
+ *	Fills in serial_in_burst/serial_out_burst unless the driver already
+ *	set them. Port types without a string I/O form (UPIO_AU, UPIO_TSI,
+ *	UPIO_HUB6) are left alone and uart_read_fifo()/uart_write_fifo()
+ *	fall back to serial_in()/serial_out() per byte.
+ */
+void uart_set_burst_io(struct uart_port *p)
+{
+	if (p->serial_in_burst || p->serial_out_burst)
+		return;
+
+	switch (p->iotype) {
+	case UPIO_PORT:
+		p->serial_in_burst = uart_port_in_burst;
+		p->serial_out_burst = uart_port_out_burst;
+		break;
+	case UPIO_MEM:
+		p->serial_in_burst = uart_mem_in_burst;
+		p->serial_out_burst = uart_mem_out_burst;
+		break;
+	case UPIO_MEM32:
+		p->serial_in_burst = uart_mem32_in_burst;
+		p->serial_out_burst = uart_mem32_out_burst;
+		break;
+	case UPIO_MEM32BE:
+		p->serial_in_burst = uart_mem32be_in_burst;
+		p->serial_out_burst = uart_mem32be_out_burst;
+		break;
+	}
+}
+
+/**
+ *	uart_read_fifo - read several bytes from a FIFO register
+ *	@p: uart port
+ *	@offset: register offset, as for serial_in()
+ *	@buf: destination
+ *	@count: bytes to read; the caller must know that many are available,
+ *		at most fifosize
+ *
+ *	One indirect call per burst instead of one serial_in() per byte.
+ */
+void uart_read_fifo(struct uart_port *p, int offset, unsigned char *buf, unsigned int count)
+{
+	if (p->serial_in_burst) {
+		p->serial_in_burst(p, offset, buf, count);
+		return;
+	}
+	while (count--)
+		*buf++ = p->serial_in(p, offset);
+}
+
+void uart_write_fifo(struct uart_port *p, int offset, const unsigned char *buf, unsigned int count)
+{
+	uart_perf_tx(p, count); // PIO 发送在这里统计, DMA 发送在 uart_dma_tx_complete() 中统计
+
+	if (p->serial_out_burst) {
+		p->serial_out_burst(p, offset, buf, count);
+		return;
+	}
+	while (count--)
+		p->serial_out(p, offset, *buf++);
+}
+
+static void
+uart_configure_port(struct uart_driver *drv, struct uart_state *state,
+		    struct uart_port *port)
+{
+	unsigned int flags;
+
+	/*
+	 * If there isn't a port here, don't do anything further.
+	 */
+	if (!port->iobase && !port->mapbase && !port->membase)
+		return;
+
+	/*
+	 * Now do the auto configuration stuff.  Note that config_port
+	 * is expected to claim the resources and map the port for us.
+	 */
+	flags = 0;
+	if (port->flags & UPF_AUTO_IRQ)
+		flags |= UART_CONFIG_IRQ;
+	if (port->flags & UPF_BOOT_AUTOCONF) {
+		if (!(port->flags & UPF_FIXED_TYPE)) {
+			port->type = PORT_UNKNOWN;
+			flags |= UART_CONFIG_TYPE;
+		}
+		port->ops->config_port(port, flags);
+	}
+
+	if (port->type != PORT_UNKNOWN) {
+		unsigned long flags;
+
+		uart_report_port(drv, port);
+
+		/*
+		 * iotype and the mapping are final now. Drivers that set
+		 * their own serial_in_burst/serial_out_burst keep them.
+		 */
+		uart_set_burst_io(port); // 否则 uart_read_fifo()/uart_write_fifo() 只能逐字节读写
+
+		/* Power up port for set_mctrl() */
+		uart_change_pm(state, UART_PM_STATE_ON);
+
+		/*
+		 * Ensure that the modem control lines are de-activated.
+		 * keep the DTR setting that is set in uart_set_options()
+		 * We probably don't need a spinlock around this, but
+		 */
+		spin_lock_irqsave(&port->lock, flags);
+		port->mctrl &= TIOCM_DTR;
+		port->ops->set_mctrl(port, port->mctrl);
+		spin_unlock_irqrestore(&port->lock, flags);
+
+		/*
+		 * If this driver supports console, and it hasn't been
+		 * successfully registered yet, try to re-register it.
+		 * It may be that the port was not available.
+		 */
+		if (port->cons && !(port->cons->flags & CON_ENABLED))
+			register_console(port->cons);
+
+		/*
+		 * Power down all ports by default, except the
+		 * console if we have one.
+		 */
+		if (!uart_console(port))
+			uart_change_pm(state, UART_PM_STATE_OFF);
+	}
+}
+
 int uart_register_driver(struct uart_driver *drv)
 {
 	struct tty_driver *normal;
-	int i, retval;
+	char *name;
+	int retval;
 
 	BUG_ON(drv->state);
 
 	/*
-	 * Maybe we should be using a slab cache for this, especially if
-	 * we have a large number of ports to handle.
+	 * Only the table of pointers is allocated here. The uart_state
+	 * objects themselves come from a per-driver, cacheline aligned slab
+	 * cache when uart_add_one_port() first uses a line, so a driver with
+	 * a large nr neither needs one big contiguous block nor has the
+	 * tty_ports of neighbouring lines share cachelines.
 	 */
-	drv->state = kzalloc(sizeof(struct uart_state) * drv->nr, GFP_KERNEL); // 申请 drv->nr 数量的 uart_state（一个端口对应一个 uart_state？）
+	drv->state = kcalloc(drv->nr, sizeof(*drv->state), GFP_KERNEL); // 申请 drv->nr 个 uart_state 指针（一个端口对应一个 uart_state）
 	if (!drv->state)
 		goto out;
 
+	/*
+	 * Cache names must be unique (several drivers are called "serial"
+	 * or use "ttyS"), and without SLAB_NO_MERGE the cache would be
+	 * aliased with any other of the same size, which defeats keeping
+	 * one per driver. kmem_cache_create() keeps its own copy of the name.
+	 */
+	name = kasprintf(GFP_KERNEL, "uart_state-%s-%d", drv->dev_name, drv->major);
+	if (!name)
+		goto out_kfree;
+	drv->state_cache = kmem_cache_create(name, sizeof(struct uart_state), 0,
+					     SLAB_HWCACHE_ALIGN | SLAB_NO_MERGE, NULL);
+	kfree(name);
+	if (!drv->state_cache)
+		goto out_kfree;
+
 	normal = alloc_tty_driver(drv->nr);  // 申请一个 tty_driver, 用 uart_driver->nr 作为参数是因为要申请 uart_driver->nr 个 tty_struct
 	if (!normal)
-		goto out_kfree;
+		goto out_cache;
 
 	drv->tty_driver = normal;
 
@@ -55,58 +1376,133 @@ int uart_register_driver(struct uart_driver *drv)
 	normal->init_termios.c_ispeed = normal->init_termios.c_ospeed = 9600;
 	normal->flags		= TTY_DRIVER_REAL_RAW | TTY_DRIVER_DYNAMIC_DEV;
 	normal->driver_state    = drv;      // 将 uart_driver 绑定到 tty_driver （也就是绑定一个 low level driver）
+	normal->xmit_pool	= tty_xmit_pool_create(UART_XMIT_POOL_PAGES); // 一页的 xmit 环形缓冲区从这里回收, 申请失败时不用池子
 	tty_set_operations(normal, &uart_ops); // 设置 tty_operations
 
-	/*
-	 * Initialise the UART state(s).
-	 */
-	for (i = 0; i < drv->nr; i++) {
-		struct uart_state *state = drv->state + i;
-		struct tty_port *port = &state->port;  // 一个 uart_state 对应一个 tty_port
-
-		tty_port_init(port); // 初始化一个 tty_port
-		port->ops = &uart_port_ops; // 设置 tty_port_operations
-	}
-
 	retval = tty_register_driver(normal); // 初始化 tty_driver，申请设备号，并将 tty_driver 挂到全局链表 tty_drivers 中，用户空间可在 /proc/tty/driver 文件查看有哪些 tty_driver
 	if (retval >= 0)
 		return retval;
 
-	for (i = 0; i < drv->nr; i++)
-		tty_port_destroy(&drv->state[i].port);
 	put_tty_driver(normal);
+out_cache:
+	kmem_cache_destroy(drv->state_cache);
 out_kfree:
 	kfree(drv->state);
 out:
 	return -ENOMEM;
 }
-int uart_add_one_port(struct uart_driver *drv, struct uart_port *uport)
+
+/**
+ *	uart_get_state - get the uart_state of a line, allocating it on first use
+ *	@drv: uart driver the line belongs to
+ *	@line: port index
+ *
+ *	drv->state[] is a table of pointers filled on demand, so every user
+ *	goes through here instead of indexing it (an unused line has no
+ *	uart_state). Callers race only on the first use of a line: the
+ *	loser of the cmpxchg() frees its copy and returns the winner's.
+ *	Returns NULL if out of memory.
+ */
+static struct uart_state *uart_get_state(struct uart_driver *drv, unsigned int line)
 {
-	struct uart_state *state;
-	struct tty_port *port;
-	int ret = 0;
-	struct device *tty_dev;
-	int num_groups;
+	struct uart_state *state = READ_ONCE(drv->state[line]);
+	struct uart_state *old;
 
-	BUG_ON(in_interrupt());
+	if (state)
+		return state;
 
-	if (uport->line >= drv->nr)
-		return -EINVAL;
+	state = kmem_cache_zalloc(drv->state_cache, GFP_KERNEL);
+	if (!state)
+		return NULL;
 
-	state = drv->state + uport->line;
-	port = &state->port;
+	tty_port_init(&state->port); // 初始化一个 tty_port, 一个 uart_state 对应一个 tty_port
+	state->port.ops = &uart_port_ops; // 设置 tty_port_operations
+	state->port.xmit_pool = drv->tty_driver->xmit_pool; // uart_install() 可能早于 tty_port_link_device()
+	init_waitqueue_head(&state->tx_empty_wait);
+	init_waitqueue_head(&state->remove_wait);
 
-	mutex_lock(&port_mutex);
-	mutex_lock(&port->mutex);
-	if (state->uart_port) {
-		ret = -EINVAL;
-		goto out;
+	old = cmpxchg(&drv->state[line], NULL, state); // uart_install() 和 uart_add_one_port() 可能同时第一次使用这个 line
+	if (old) {
+		tty_port_destroy(&state->port);
+		kmem_cache_free(drv->state_cache, state);
+		return old;
+	}
+	return state;
+}
+
+/*
+ * tty_operations->install: the tty of a line gets that line's uart_state
+ * as driver_data, allocating it if no port was ever added (the open then
+ * fails in uart_port_activate() with -ENXIO, as before).
+ */
+static int uart_install(struct tty_driver *driver, struct tty_struct *tty)
+{
+	struct uart_driver *drv = driver->driver_state;
+	struct uart_state *state = uart_get_state(drv, tty->index); // 原来是 drv->state + tty->index
+
+	if (!state)
+		return -ENOMEM;
+	tty->driver_data = state;
+
+	return tty_standard_install(driver, tty);
+}
+
+void uart_unregister_driver(struct uart_driver *drv)
+{
+	struct tty_driver *p = drv->tty_driver;
+	unsigned int i;
+
+	tty_unregister_driver(p);
+	put_tty_driver(p);
+	for (i = 0; i < drv->nr; i++) {
+		struct uart_state *state = drv->state[i];
+
+		if (!state) // 从未使用过的 line 没有 uart_state
+			continue;
+		tty_port_destroy(&state->port);
+		kmem_cache_free(drv->state_cache, state);
 	}
+	kmem_cache_destroy(drv->state_cache);
+	kfree(drv->state);
+	drv->state = NULL;
+	drv->state_cache = NULL;
+	drv->tty_driver = NULL;
+}
+
+/*
+ * NUMA node for the port's buffers: that of the CPUs its interrupt is
+ * affine to, when they all sit on one node, else that of the device.
+ */
+static int uart_port_node(struct uart_port *uport)
+{
+	const struct cpumask *mask = uport->irq ? irq_get_affinity_mask(uport->irq) : NULL;
+	int first, last;
+
+	if (mask && !cpumask_empty(mask)) {
+		first = cpumask_first(mask);
+		last = cpumask_last(mask);
+		if (cpu_to_node(first) == cpu_to_node(last)) // 默认亲和性是所有 cpu, 跨 node 时不能说明什么
+			return cpu_to_node(first);
+	}
+	return uport->dev ? dev_to_node(uport->dev) : NUMA_NO_NODE;
+}
+
+/*
+ * First half of uart_add_one_port(): link @uport to its line and set up
+ * its tty attribute groups. Called with port_mutex and port->mutex held.
+ */
+static int uart_port_attach(struct uart_driver *drv, struct uart_state *state, struct uart_port *uport)
+{
+	int num_groups;
+
+	if (state->uart_port)
+		return -EINVAL;
 
 	/* Link the port to the driver state table and vice versa */
 	state->uart_port = uport; // 将 uart_port 绑定到 uart_state
 	uport->state = state; // 指定 uart_port 从属于哪个 uart_state
 
+	atomic_set(&state->refcount, 1); // uart_remove_one_port() 中释放
 	state->pm_state = UART_PM_STATE_UNDEFINED;
 	uport->cons = drv->cons;
 	uport->minor = drv->tty_driver->minor_start + uport->line;
@@ -123,6 +1519,7 @@ int uart_add_one_port(struct uart_driver *drv, struct uart_port *uport)
 		of_console_check(uport->dev->of_node, uport->cons->name, uport->line);
 
 	uart_configure_port(drv, state, uport);
+	state->port.node = uart_port_node(uport); // irq 已经确定, flip 缓冲区和 xmit 环形缓冲区在这个 node 上申请
 
 	num_groups = 2;
 	if (uport->attr_group)
@@ -130,24 +1527,24 @@ int uart_add_one_port(struct uart_driver *drv, struct uart_port *uport)
 
 	uport->tty_groups = kcalloc(num_groups, sizeof(*uport->tty_groups),
 				    GFP_KERNEL);
-	if (!uport->tty_groups) {
-		ret = -ENOMEM;
-		goto out;
-	}
+	if (!uport->tty_groups)
+		return -ENOMEM;
 	uport->tty_groups[0] = &tty_dev_attr_group;
 	if (uport->attr_group)
 		uport->tty_groups[1] = uport->attr_group;
 
-	/*
-	 * Register the port whether it's detected or not.  This allows
-	 * setserial to be used to alter this port's parameters.
-	 */
-	tty_dev = struct device *tty_port_register_device_attr(struct tty_port *port, struct tty_driver *driver = drv->tty_driver, unsigned index = uport->line,
-				struct device *device = uport->dev, void *drvdata = port, const struct attribute_group **attr_grp = uport->tty_groups); // 注册相应的字符设备和 sysfs 下面的设备
-		tty_port_link_device(port, driver, index);
-		return tty_register_device_attr(driver = drv->tty_driver, index = uport->line, device = uport->dev, drvdata = port, attr_grp = uport->tty_groups);
+	return 0;
+}
+
+/*
+ * Second half: @tty_dev is the registered tty device or an ERR_PTR.
+ * Called with port_mutex and port->mutex held.
+ */
+static void uart_port_attached(struct uart_port *uport, struct device *tty_dev)
+{
 	if (likely(!IS_ERR(tty_dev))) {
 		device_set_wakeup_capable(tty_dev, 1);
+		uart_perf_add(uport, tty_dev); // 创建 debugfs 下的 perf 文件
 	} else {
 		dev_err(uport->dev, "Cannot register tty device on line %d\n",
 		       uport->line);
@@ -157,9 +1554,245 @@ int uart_add_one_port(struct uart_driver *drv, struct uart_port *uport)
 	 * Ensure UPF_DEAD is not set.
 	 */
 	uport->flags &= ~UPF_DEAD;
+}
+
+/*
+ * Body of uart_add_one_port(); the caller holds port_mutex so that
+ * uart_add_ports() can take it once for a whole board.
+ */
+static int __uart_add_one_port(struct uart_driver *drv, struct uart_port *uport)
+{
+	struct uart_state *state;
+	struct tty_port *port;
+	int ret = 0;
+	struct device *tty_dev;
+
+	if (uport->line >= drv->nr)
+		return -EINVAL;
+
+	state = uart_get_state(drv, uport->line);
+	if (!state)
+		return -ENOMEM;
+	port = &state->port;
+
+	mutex_lock(&port->mutex);
+	ret = uart_port_attach(drv, state, uport);
+	if (ret)
+		goto out;
+
+	/*
+	 * Register the port whether it's detected or not.  This allows
+	 * setserial to be used to alter this port's parameters.
+	 */
+	tty_dev = struct device *tty_port_register_device_attr(struct tty_port *port, struct tty_driver *driver = drv->tty_driver, unsigned index = uport->line,
+				struct device *device = uport->dev, void *drvdata = port, const struct attribute_group **attr_grp = uport->tty_groups); // 注册相应的字符设备和 sysfs 下面的设备
+		tty_port_link_device(port, driver, index);
+		return tty_register_device_attr(driver = drv->tty_driver, index = uport->line, device = uport->dev, drvdata = port, attr_grp = uport->tty_groups);
+	uart_port_attached(uport, tty_dev);
 
  out:
 	mutex_unlock(&port->mutex);
+
+	return ret;
+}
+
+int uart_add_one_port(struct uart_driver *drv, struct uart_port *uport)
+{
+	int ret;
+
+	BUG_ON(in_interrupt());
+
+	mutex_lock(&port_mutex);
+	ret = __uart_add_one_port(drv, uport);
+	mutex_unlock(&port_mutex);
+
+	return ret;
+}
+
+/* Lines first..first + nr - 1, in order, all under the same parent */
+static bool uart_ports_contiguous(struct uart_driver *drv, struct uart_port **uports, int nr)
+{
+	int i;
+
+	if (uports[0]->line + nr > drv->nr)
+		return false;
+	for (i = 1; i < nr; i++)
+		if (uports[i]->line != uports[0]->line + i || uports[i]->dev != uports[0]->dev)
+			return false;
+	return true;
+}
+
+/*
+ * uart_add_ports() for consecutive lines: attach every port, then
+ * register all tty devices with one tty_register_device_range_attr()
+ * call. If that fails the ports are registered one by one, which is what
+ * uart_add_one_port() would have done (and reports per line errors).
+ * Called with port_mutex held; no device node exists for these lines
+ * until the registration, so port->mutex need not be held across it.
+ */
+static int __uart_add_port_range(struct uart_driver *drv, struct uart_port **uports, int nr)
+{
+	struct tty_driver *driver = drv->tty_driver;
+	const struct attribute_group ***groups;
+	struct device **devs;
+	void **drvdata;
+	int i, attached, ret = 0;
+
+	drvdata = kcalloc(nr, sizeof(*drvdata), GFP_KERNEL);
+	groups = kcalloc(nr, sizeof(*groups), GFP_KERNEL);
+	devs = kcalloc(nr, sizeof(*devs), GFP_KERNEL);
+	if (!drvdata || !groups || !devs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (attached = 0; attached < nr; attached++) {
+		struct uart_port *uport = uports[attached];
+		struct uart_state *state = uart_get_state(drv, uport->line);
+
+		if (!state) {
+			ret = -ENOMEM;
+			break;
+		}
+		mutex_lock(&state->port.mutex);
+		ret = uart_port_attach(drv, state, uport);
+		mutex_unlock(&state->port.mutex);
+		if (ret)
+			break;
+		tty_port_link_device(&state->port, driver, uport->line);
+		drvdata[attached] = &state->port;
+		groups[attached] = uport->tty_groups;
+	}
+
+	if (ret || tty_register_device_range_attr(driver, uports[0]->line, nr, uports[0]->dev, drvdata, groups, devs)) {
+		for (i = 0; i < attached; i++) // 逐个注册, 和 uart_add_one_port() 的结果一样
+			devs[i] = tty_register_device_attr(driver, uports[i]->line, uports[i]->dev, drvdata[i], groups[i]);
+	}
+
+	for (i = 0; i < attached; i++) {
+		struct tty_port *port = drvdata[i];
+
+		mutex_lock(&port->mutex);
+		uart_port_attached(uports[i], devs[i]);
+		mutex_unlock(&port->mutex);
+	}
+out:
+	kfree(devs);
+	kfree(groups);
+	kfree(drvdata);
+	return ret;
+}
+
+/**
+ *	uart_add_ports - attach a batch of driver-defined port structures
+ *	@drv: pointer to the uart low level driver structure for these ports
+ *	@uports: array of uart port structures
+ *	@nr: number of entries in @uports
+ *
+ *	Same as calling uart_add_one_port() for every entry, but port_mutex
+ *	is taken once for the whole batch. Meant for multi-port cards that
+ *	bring up hundreds of lines in probe. When the ports cover consecutive
+ *	lines under one parent device, their tty devices are registered
+ *	together with tty_register_device_range_attr(). Stops at the first
+ *	failure and returns its error; ports added before it stay registered.
+ */
+int uart_add_ports(struct uart_driver *drv, struct uart_port **uports, int nr)
+{
+	int i, ret = 0;
+
+	BUG_ON(in_interrupt());
+
+	mutex_lock(&port_mutex); // 整块板卡只拿一次全局的 port_mutex
+	if (nr > 1 && uart_ports_contiguous(drv, uports, nr))
+		ret = __uart_add_port_range(drv, uports, nr);
+	else
+		for (i = 0; i < nr && !ret; i++)
+			ret = __uart_add_one_port(drv, uports[i]);
+	mutex_unlock(&port_mutex);
+
+	return ret;
+}
+
+/**
+ *	uart_remove_one_port - detach a driver defined port structure
+ *	@drv: pointer to the uart low level driver structure for this port
+ *	@uport: uart port structure for this port
+ *
+ *	This unhooks (and hangs up) the specified port structure from the
+ *	core driver.  No further calls will be made to the low-level code
+ *	for this port.
+ */
+int uart_remove_one_port(struct uart_driver *drv, struct uart_port *uport)
+{
+	struct uart_state *state = uport->state; // 原来是 drv->state + uport->line, 没有添加成功的端口 state 为 NULL
+	struct tty_port *port;
+	struct uart_port *uart_port;
+	struct tty_struct *tty;
+	int ret = 0;
+
+	BUG_ON(in_interrupt());
+
+	if (!state)
+		return -EINVAL;
+	port = &state->port;
+
+	mutex_lock(&port_mutex);
+
+	/*
+	 * Mark the port "dead" - this prevents any opens from
+	 * succeeding while we shut down the port.
+	 */
+	mutex_lock(&port->mutex);
+	uart_port = uart_port_check(state);
+	if (uart_port != uport)
+		dev_alert(uport->dev, "Removing wrong port: %p != %p\n",
+			  uart_port, uport);
+
+	if (!uart_port) {
+		mutex_unlock(&port->mutex);
+		ret = -EINVAL;
+		goto out;
+	}
+	uport->flags |= UPF_DEAD;
+	mutex_unlock(&port->mutex);
+
+	/*
+	 * Remove the devices from the tty layer
+	 */
+	tty_port_unregister_device(port, drv->tty_driver, uport->line);
+
+	tty = tty_port_tty_get(port);
+	if (tty) {
+		tty_vhangup(port->tty);
+		tty_kref_put(tty);
+	}
+
+	/*
+	 * If the port is used as a console, unregister it
+	 */
+	if (uart_console(uport))
+		unregister_console(uport->cons);
+
+	/*
+	 * Free the port IO and memory resources, if any.
+	 */
+	if (uport->type != PORT_UNKNOWN && uport->ops->release_port)
+		uport->ops->release_port(uport);
+	kfree(uport->tty_groups);
+
+	/*
+	 * Indicate that there isn't a port here anymore.
+	 */
+	uport->type = PORT_UNKNOWN;
+
+	mutex_lock(&port->mutex);
+	WARN_ON(atomic_dec_return(&state->refcount) < 0);
+	wait_event(state->remove_wait, !atomic_read(&state->refcount));
+	state->uart_port = NULL;
+	mutex_unlock(&port->mutex);
+
+	uart_perf_remove(uport); // 删除 debugfs 目录, 释放 percpu 计数
+out:
 	mutex_unlock(&port_mutex);
 
 	return ret;
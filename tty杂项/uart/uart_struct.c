@@ -1,3 +1,41 @@
+/*
+ * Per-port performance counters. The hot counters live in a per-cpu
+ * struct uart_perf_pcpu; reading the debugfs "perf" file of a port sums
+ * them into one struct uart_perf record (fixed layout, native endian).
+ */
+#define UART_PERF_IRQ_BUCKETS   16      /* bucket n: irq took < 256ns << n */
+
+struct uart_perf_pcpu {
+    u64     rx_bytes;
+    u64     tx_bytes;
+    u64     irqs;
+    u64     irq_hist[UART_PERF_IRQ_BUCKETS];
+};
+
+struct uart_perf {
+    __u64   timestamp_ns;           /* ktime_get_ns() at read, for rates */
+    __u64   rx_bytes;
+    __u64   tx_bytes;
+    __u64   irqs;
+    __u64   irq_hist[UART_PERF_IRQ_BUCKETS];
+    __u64   throttled_ns;           /* total time spent throttled */
+    __u32   flip_hwm;               /* flip buffer bytes high-water mark */
+    __u32   tx_ring_hwm;            /* xmit pending bytes high-water mark */
+};
+
+/*
+ * RX interrupt coalescing, set with TIOCSRXCOAL or the rx_coalesce sysfs
+ * attribute. Zero means driver default / no limit.
+ */
+struct serial_rx_coalesce {
+    __u32   rx_trigger;     /* RX FIFO trigger level, bytes */
+    __u32   rx_timeout_us;  /* idle time before an RX timeout irq */
+    __u32   max_irq_rate;   /* RX irqs per second to aim for */
+};
+
+#define TIOCGRXCOAL _IOR('T', 0x44, struct serial_rx_coalesce)  // 跟在 TIOCSISO7816 (0x43) 之后
+#define TIOCSRXCOAL _IOWR('T', 0x45, struct serial_rx_coalesce) // 驱动取整后的值写回用户
+
 /*
  * This structure describes all the operations that can be done on the
  * physical hardware.  See Documentation/serial/driver for details.
@@ -42,6 +80,40 @@ struct uart_ops {
     void        (*config_port)(struct uart_port *, int);
     int     (*verify_port)(struct uart_port *, struct serial_struct *);
     int     (*ioctl)(struct uart_port *, unsigned int, unsigned long);
+
+    /*
+     * Optional. Start a DMA transfer of the scatterlist built by
+     * uart_dma_tx_start() (one or two entries, the second one when the
+     * data wraps around the end of xmit). Map it for your DMA device,
+     * submit it and call uart_dma_tx_complete() from the completion.
+     * Called with the port lock held.
+     */
+    int     (*dma_tx_submit)(struct uart_port *, struct scatterlist *sgl,
+                     int nents);
+
+    /*
+     * Optional. Start receiving into @buf (@len bytes) by DMA. Call
+     * uart_dma_rx_complete() when it is full and uart_dma_rx_idle()
+     * on a receiver idle/timeout interrupt. Called with the port lock
+     * held.
+     */
+    int     (*dma_rx_start)(struct uart_port *, unsigned char *buf,
+                    unsigned int len);
+
+    /*
+     * Optional. Program RX FIFO trigger level and receive timeout.
+     * Round the values to what the hardware supports and write them
+     * back. Called with the port mutex held.
+     */
+    int     (*set_rx_coalesce)(struct uart_port *,
+                       struct serial_rx_coalesce *);
+
+    /*
+     * Optional. Enable/disable the transmitter-empty (TEMT) interrupt;
+     * while enabled, call uart_tx_empty_notify() when the last bit has
+     * left the shift register. Called with the port lock held.
+     */
+    void        (*tx_empty_irq)(struct uart_port *, int enable);
 #ifdef CONFIG_CONSOLE_POLL
     int     (*poll_init)(struct uart_port *);
     void        (*poll_put_char)(struct uart_port *, unsigned char);
@@ -56,6 +128,11 @@ struct uart_port {
     unsigned char __iomem   *membase;       /* read/write[bwl] */
     unsigned int        (*serial_in)(struct uart_port *, int);
     void            (*serial_out)(struct uart_port *, int, int);
+    /* optional, move up to fifosize bytes through one FIFO register */
+    void            (*serial_in_burst)(struct uart_port *, int,
+                           unsigned char *, unsigned int);
+    void            (*serial_out_burst)(struct uart_port *, int,
+                            const unsigned char *, unsigned int);
     void            (*set_termios)(struct uart_port *,
                                struct ktermios *new,
                                struct ktermios *old);
@@ -91,6 +168,13 @@ struct uart_port {
     unsigned int        ignore_status_mask; /* driver specific */
     struct uart_state   *state;         /* pointer to parent state */
     struct uart_icount  icount;         /* statistics */
+    struct serial_rx_coalesce rx_coalesce;  /* as programmed by the driver */
+    struct uart_perf_pcpu __percpu *perf;   /* NULL if allocation failed */
+    struct dentry       *perf_dir;      /* debugfs serial/<ttyname> */
+    u32                 flip_hwm;       /* see struct uart_perf */
+    u32                 tx_ring_hwm;
+    u64                 throttled_ns;
+    u64                 throttle_start; /* ktime_get_ns(), 0 if not throttled */
 
     struct console      *cons;          /* struct console, if any */
 #if defined(CONFIG_SERIAL_CORE_CONSOLE) || defined(SUPPORT_SYSRQ)
@@ -178,7 +262,8 @@ struct uart_port {
     unsigned char       hub6;           /* this should be in the 8250 driver */
     unsigned char       suspended;
     unsigned char       irq_wake;
-    unsigned char       unused[2];
+    unsigned char       xmit_resizable; /* driver indexes xmit with state->xmit_size */
+    unsigned char       unused[1];
     struct attribute_group  *attr_group;        /* port specific attributes */
     const struct attribute_group **tty_groups;  /* all attributes (serial core use only) */
     struct serial_rs485     rs485;
@@ -187,18 +272,48 @@ struct uart_port {
 
 
 
+/*
+ * Receive DMA state used by uart_dma_rx_*(). The two buffers are used in
+ * turn: the hardware fills buf[cur] while the other one is pushed to the
+ * tty layer.
+ */
+struct uart_dma_rx {
+    unsigned char       *buf[2];
+    unsigned int        len;            /* size of each buffer */
+    unsigned int        cur;            /* buffer being filled */
+    unsigned int        pushed;         /* bytes of buf[cur] already pushed */
+};
+
 /*
  * This is the state information which is persistent across opens.
  */
-struct uart_state {  // 这个结构体不应该在 low level driver (uart 驱动层 是一种 low level driver) 中注册, 它在 uart_register_driver() 时会由 uart 核心层注册
+struct uart_state {  // 这个结构体不应该在 low level driver (uart 驱动层 是一种 low level driver) 中注册, 它在 uart_add_one_port() 第一次使用该 line 时由 uart 核心层从 uart_driver->state_cache 中申请
     struct tty_port     port;
 
     enum uart_pm_state  pm_state;
     struct circ_buf     xmit;
+    unsigned int        xmit_size;      /* power of 2, UART_XMIT_SIZE by default */
+    unsigned int        wakeup_chars;   /* wake writers below this many pending */
 
+    struct scatterlist  tx_sg[2];       /* xmit segments in flight */
+    unsigned int        tx_dma_len;     /* bytes in flight, 0 if idle */
+    struct uart_dma_rx  rx_dma;
+    wait_queue_head_t   tx_empty_wait;  /* uart_wait_until_sent() */
+
+    atomic_t        refcount;       /* uart_port_ref() */
+    wait_queue_head_t   remove_wait;
     struct uart_port    *uart_port;
 };
 
+/*
+ * uart_circ_chars_pending() and "& (UART_XMIT_SIZE - 1)" assume the old
+ * one page ring. Code that may see a resized ring uses these instead.
+ */
+#define uart_xmit_pending(state) \
+    CIRC_CNT((state)->xmit.head, (state)->xmit.tail, (state)->xmit_size)
+#define uart_xmit_consume(state, n) \
+    ((state)->xmit.tail = ((state)->xmit.tail + (n)) & ((state)->xmit_size - 1))
+
 
 
 struct uart_driver {
@@ -214,7 +329,8 @@ struct uart_driver {
      * these are private; the low level driver should not
      * touch these; they should be initialised to NULL
      */
-    struct uart_state   *state;
+    struct uart_state   **state;        /* per line, allocated on add */
+    struct kmem_cache   *state_cache;   /* cacheline aligned uart_state */
     struct tty_driver   *tty_driver;
 };
 
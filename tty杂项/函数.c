@@ -18,8 +18,8 @@
  *
  * WSH 06/09/97: Rewritten to remove races and properly clean up after a
  * failed open.  The new code protects the open with a mutex, so it's
- * really quite straightforward.  The mutex locking can probably be
- * relaxed for the (most common) case of reopening a tty.
+ * really quite straightforward.  The (most common) case of reopening a
+ * tty no longer gets here, see tty_reopen_fast().
  */
 
 struct tty_struct *tty_init_dev(struct tty_driver *driver, int idx)
@@ -89,6 +89,753 @@ err_release_tty:
 	return ERR_PTR(retval);
 }
 
+/*
+ * tty_structs come from their own slab cache and are returned to it only
+ * after an RCU grace period, so tty_reopen_fast() can look at
+ * driver->ttys[] without holding tty_mutex. The cache also keeps freed
+ * objects warm for the next open of a port that is opened and closed
+ * thousands of times a minute.
+ */
+static struct kmem_cache *tty_struct_cachep; // 在 tty_init() 中创建
+
+struct tty_struct *alloc_tty_struct(struct tty_driver *driver, int idx)
+{
+	struct tty_struct *tty;
+
+	tty = kmem_cache_zalloc(tty_struct_cachep, GFP_KERNEL); // 原来是 kzalloc(sizeof(*tty), GFP_KERNEL)
+	if (!tty)
+		return NULL;
+
+	if (init_ldsem(&tty->ldisc_sem)) { // 需要分配 percpu 读计数, 放在 tty_ldisc_init() 之前, 失败时不用再释放线路规程
+		kmem_cache_free(tty_struct_cachep, tty);
+		return NULL;
+	}
+	kref_init(&tty->kref);
+	tty->magic = TTY_MAGIC;
+	tty_ldisc_init(tty);
+	tty->session = NULL;
+	tty->pgrp = NULL;
+	mutex_init(&tty->legacy_mutex);
+	mutex_init(&tty->throttle_mutex);
+	init_rwsem(&tty->termios_rwsem);
+	mutex_init(&tty->winsize_mutex);
+	init_waitqueue_head(&tty->write_wait);
+	init_waitqueue_head(&tty->read_wait);
+	mutex_init(&tty->atomic_write_lock);
+	spin_lock_init(&tty->ctrl_lock);
+	spin_lock_init(&tty->flow_lock);
+	spin_lock_init(&tty->files_lock); // 代替全局的 tty_files_lock
+	INIT_LIST_HEAD(&tty->tty_files);
+	INIT_WORK(&tty->SAK_work, do_SAK_work);
+
+	tty->driver = driver;
+	tty->ops = driver->ops;
+	tty->index = idx;
+	tty_line_name(driver, idx, tty->name);
+	tty->dev = tty_get_device(tty);
+
+	return tty;
+}
+
+static void tty_struct_free_rcu(struct rcu_head *rcu)
+{
+	kmem_cache_free(tty_struct_cachep, container_of(rcu, struct tty_struct, rcu));
+}
+
+void free_tty_struct(struct tty_struct *tty)
+{
+	tty_ldisc_deinit(tty);
+	ldsem_free(&tty->ldisc_sem);
+	put_device(tty->dev);
+	kvfree(tty->write_buf); // do_tty_write() 用 kvmalloc() 申请
+	tty->magic = 0xDEADDEAD;
+	call_rcu(&tty->rcu, tty_struct_free_rcu); // 等 tty_reopen_fast() 中的 RCU 读者都退出后再还给 slab
+}
+
+/*
+ * Ok, now we can initialize the rest of the tty devices and can count
+ * on memory allocations, interrupts etc..
+ */
+int __init tty_init(void)
+{
+	int cpu;
+
+	tty_struct_cachep = KMEM_CACHE(tty_struct, SLAB_HWCACHE_ALIGN | SLAB_PANIC); // alloc_tty_struct() 从这里申请, 在注册任何 tty 设备之前创建
+	for_each_possible_cpu(cpu) { // tty_hangup() 使用的每 cpu 链表和工作项
+		struct tty_hangup_batch *batch = per_cpu_ptr(&tty_hangup_batches, cpu);
+
+		init_llist_head(&batch->list);
+		INIT_WORK(&batch->work, tty_hangup_batch);
+	}
+	if (tty_buffer_shrinker_init()) // 空闲端口的 tty_buffer 缓存交给 shrinker 回收, 以及 debugfs 下的 tty_flip
+		pr_warn("tty: flip buffer shrinker not registered\n");
+
+	cdev_init(&tty_cdev, &tty_fops);
+	if (cdev_add(&tty_cdev, MKDEV(TTYAUX_MAJOR, 0), 1) ||
+	    register_chrdev_region(MKDEV(TTYAUX_MAJOR, 0), 1, "/dev/tty") < 0)
+		panic("Couldn't register /dev/tty driver\n");
+	device_create(tty_class, NULL, MKDEV(TTYAUX_MAJOR, 0), NULL, "tty");
+
+	cdev_init(&console_cdev, &console_fops);
+	if (cdev_add(&console_cdev, MKDEV(TTYAUX_MAJOR, 1), 1) ||
+	    register_chrdev_region(MKDEV(TTYAUX_MAJOR, 1), 1, "/dev/console") < 0)
+		panic("Couldn't register /dev/console driver\n");
+	consdev = device_create_with_groups(tty_class, NULL,
+					    MKDEV(TTYAUX_MAJOR, 1), NULL,
+					    cons_dev_groups, "console");
+	if (IS_ERR(consdev))
+		consdev = NULL;
+
+#ifdef CONFIG_VT
+	vty_init(&console_fops);
+#endif
+	return 0;
+}
+
+/**
+ *	tty_lookup_driver - lookup a tty driver for a given device file
+ *	@device: device number
+ *	@filp: file pointer to tty
+ *	@index: index for the device in the @return driver
+ *	@return: driver for this inode (with increased refcount)
+ *
+ *	If @return is not erroneous, the caller is responsible to decrement the
+ *	refcount by tty_driver_kref_put.
+ *
+ *	Locking: tty_mutex for the /dev/tty0 and /dev/console branches, which
+ *		 pick the driver from console state rather than from the
+ *		 device number; none for everything else (see get_tty_driver())
+ */
+static struct tty_driver *tty_lookup_driver(dev_t device, struct file *filp,
+		int *index)
+{
+	struct tty_driver *driver = NULL;
+
+	switch (device) {
+#ifdef CONFIG_VT
+	case MKDEV(TTY_MAJOR, 0): {
+		extern struct tty_driver *console_driver;
+
+		mutex_lock(&tty_mutex); // fg_console 和 console_driver 仍然在 tty_mutex 下读取
+		driver = tty_driver_kref_get(console_driver);
+		*index = fg_console;
+		mutex_unlock(&tty_mutex);
+		break;
+	}
+#endif
+	case MKDEV(TTYAUX_MAJOR, 1): {
+		struct tty_driver *console_driver;
+
+		mutex_lock(&tty_mutex);
+		console_driver = console_device(index);
+		if (console_driver) {
+			driver = tty_driver_kref_get(console_driver);
+			if (driver && filp) {
+				/* Don't let /dev/console block */
+				filp->f_flags |= O_NONBLOCK;
+				mutex_unlock(&tty_mutex);
+				break;
+			}
+		}
+		mutex_unlock(&tty_mutex);
+		if (driver)
+			tty_driver_kref_put(driver);
+		return ERR_PTR(-ENODEV);
+	}
+	default:
+		driver = get_tty_driver(device, index); // 只有这条路径不需要 tty_mutex
+		if (!driver)
+			return ERR_PTR(-ENODEV);
+		break;
+	}
+	return driver;
+}
+
+/**
+ *	tty_reopen_fast	-	reopen an active tty without tty_mutex
+ *	@driver: tty driver the device belongs to
+ *	@idx: device index
+ *
+ *	Fast path of tty_open_by_driver() for the common case of opening a
+ *	tty that is already open. The driver->ttys[] slot is read under RCU
+ *	and pinned with kref_get_unless_zero(), so only the per-tty lock is
+ *	taken. Returns NULL if the caller has to fall back to the tty_mutex
+ *	path (no tty installed yet, or a driver with its own ->lookup), the
+ *	tty locked on success, or an ERR_PTR.
+ *
+ *	Locking: takes tty_lock, never tty_mutex
+ */
+static struct tty_struct *tty_reopen_fast(struct tty_driver *driver, int idx)
+{
+	struct tty_struct *tty;
+	int retval;
+
+	if (driver->ops->lookup) // pty 等驱动自己实现了查找, 仍然走 tty_mutex 保护的慢路径
+		return NULL;
+
+	rcu_read_lock();
+	tty = READ_ONCE(driver->ttys[idx]);
+	if (tty && !kref_get_unless_zero(&tty->kref)) // 引用计数已经为 0, 说明 tty 正在被释放
+		tty = NULL;
+	rcu_read_unlock();
+	if (!tty)
+		return NULL;
+
+	retval = tty_lock_interruptible(tty);
+	if (retval) {
+		tty_kref_put(tty);
+		return ERR_PTR(retval == -EINTR ? -ERESTARTSYS : retval);
+	}
+
+	if (driver->ttys[idx] != tty) { // 拿锁之前 tty 被 release_tty() 从表中摘掉了
+		tty_unlock(tty);
+		tty_kref_put(tty);
+		return NULL;
+	}
+	tty_kref_put(tty); /* tty_lock and tty->count hold it from here */
+
+	retval = tty_reopen(tty); // tty->count 为 0 (正在关闭) 时返回 -EAGAIN, tty_open() 会重试
+	if (retval < 0) {
+		tty_unlock(tty);
+		return ERR_PTR(retval);
+	}
+	return tty;
+}
+
+static struct tty_struct *tty_open_by_driver(dev_t device, struct inode *inode, struct file *filp)
+{
+	struct tty_struct *tty;
+	struct tty_driver *driver = NULL;
+	int index = -1;
+	int retval;
+
+	driver = tty_lookup_driver(device, filp, &index); // 只在 /dev/tty0 和 /dev/console 分支拿 tty_mutex
+	if (IS_ERR(driver))
+		return ERR_CAST(driver);
+
+	tty = tty_reopen_fast(driver, index); // 重复打开一个已经打开的 tty, 不需要 tty_mutex
+	if (tty)
+		goto out;
+
+	mutex_lock(&tty_mutex);
+	/* check whether we're reopening an existing tty */
+	tty = tty_driver_lookup_tty(driver, filp, index);
+	if (IS_ERR(tty)) {
+		mutex_unlock(&tty_mutex);
+		goto out;
+	}
+
+	if (tty) {
+		mutex_unlock(&tty_mutex);
+		retval = tty_lock_interruptible(tty);
+		tty_kref_put(tty);  /* drop kref from tty_driver_lookup_tty() */
+		if (retval) {
+			if (retval == -EINTR)
+				retval = -ERESTARTSYS;
+			tty = ERR_PTR(retval);
+			goto out;
+		}
+		retval = tty_reopen(tty);
+		if (retval < 0) {
+			tty_unlock(tty);
+			tty = ERR_PTR(retval);
+		}
+	} else { /* Returns with the tty_lock held for now */
+		tty = tty_init_dev(driver, index); // 第一次打开
+		mutex_unlock(&tty_mutex);
+	}
+out:
+	tty_driver_kref_put(driver);
+	return tty;
+}
+
+static int check_tty_count(struct tty_struct *tty, const char *routine)
+{
+#ifdef CHECK_TTY_COUNT
+	struct list_head *p;
+	int count = 0;
+
+	spin_lock(&tty->files_lock); // 原来是全局的 tty_files_lock
+	list_for_each(p, &tty->tty_files) {
+		count++;
+	}
+	spin_unlock(&tty->files_lock);
+	if (tty->driver->type == TTY_DRIVER_TYPE_PTY &&
+	    tty->driver->subtype == PTY_TYPE_SLAVE &&
+	    tty->link && tty->link->count)
+		count++;
+	if (tty->count != count) {
+		printk(KERN_WARNING "Warning: dev (%s) tty->count(%d) "
+				    "!= #fd's(%d) in %s\n",
+		       tty->name, tty->count, count, routine);
+		return count;
+	}
+#endif
+	return 0;
+}
+
+/* Associate a new file with the tty structure */
+void tty_add_file(struct tty_struct *tty, struct file *file)
+{
+	struct tty_file_private *priv = file->private_data;
+
+	priv->tty = tty;
+	priv->file = file;
+
+	spin_lock(&tty->files_lock); // 原来是全局的 tty_files_lock
+	list_add(&priv->list, &tty->tty_files);
+	spin_unlock(&tty->files_lock);
+}
+
+/* Delete file from its tty */
+static void tty_del_file(struct file *file)
+{
+	struct tty_file_private *priv = file->private_data;
+	struct tty_struct *tty = priv->tty;
+
+	spin_lock(&tty->files_lock); // 原来是全局的 tty_files_lock
+	list_del(&priv->list);
+	spin_unlock(&tty->files_lock);
+	tty_free_file(file);
+}
+
+/**
+ *	tty_open		-	open a tty device
+ *	@inode: inode of device file
+ *	@filp: file pointer to tty
+ *
+ *	tty_open and tty_release keep up the tty count that contains the
+ *	number of opens done on a tty. We cannot use the inode-count, as
+ *	different inodes might point to the same tty.
+ *
+ *	The file is marked FMODE_NOWAIT if the ldisc declares
+ *	LDISC_FLAG_NOWAIT: its reads and writes honour IOCB_NOWAIT and
+ *	return -EAGAIN instead of sleeping, so io_uring can try them inline
+ *	before punting to a worker. Should the ldisc be changed later to one
+ *	without the flag, tty_read_iter() and tty_write_iter() turn every
+ *	IOCB_NOWAIT attempt away with -EAGAIN.
+ *
+ *	Locking:
+ *		tty_mutex only for a first open (tty_init_dev()) and for the
+ *		console lookups, see tty_open_by_driver().
+ */
+static int tty_open(struct inode *inode, struct file *filp)
+{
+	struct tty_struct *tty;
+	struct tty_ldisc *ld;
+	int noctty, retval;
+	dev_t device = inode->i_rdev;
+	unsigned saved_flags = filp->f_flags;
+
+	nonseekable_open(inode, filp);
+
+retry_open:
+	retval = tty_alloc_file(filp);
+	if (retval)
+		return -ENOMEM;
+
+	tty = tty_open_current_tty(device, filp);
+	if (!tty)
+		tty = tty_open_by_driver(device, inode, filp);
+
+	if (IS_ERR(tty)) {
+		tty_free_file(filp);
+		retval = PTR_ERR(tty);
+		if (retval != -EAGAIN || signal_pending(current))
+			return retval;
+		schedule();
+		goto retry_open;
+	}
+
+	tty_add_file(tty, filp);
+
+	check_tty_count(tty, __func__);
+	tty_debug_hangup(tty, "opening (count=%d)\n", tty->count);
+
+	if (tty->ops->open)
+		retval = tty->ops->open(tty, filp);
+	else
+		retval = -ENODEV;
+	filp->f_flags = saved_flags;
+
+	if (retval) {
+		tty_debug_hangup(tty, "open error %d, releasing\n", retval);
+
+		tty_unlock(tty); /* need to call tty_release without BTM */
+		tty_release(inode, filp);
+		if (retval != -ERESTARTSYS)
+			return retval;
+
+		if (signal_pending(current))
+			return retval;
+
+		schedule();
+		/*
+		 * Need to reset f_op in case a hangup happened.
+		 */
+		if (tty_hung_up_p(filp))
+			filp->f_op = &tty_fops;
+		goto retry_open;
+	}
+	clear_bit(TTY_HUPPED, &tty->flags);
+
+	noctty = (filp->f_flags & O_NOCTTY) ||
+		 (IS_ENABLED(CONFIG_VT) && device == MKDEV(TTY_MAJOR, 0)) ||
+		 device == MKDEV(TTYAUX_MAJOR, 1) ||
+		 (tty->driver->type == TTY_DRIVER_TYPE_PTY &&
+		  tty->driver->subtype == PTY_TYPE_MASTER);
+	if (!noctty)
+		tty_open_proc_set_tty(filp, tty);
+	ld = tty_ldisc_ref(tty);
+	if (ld) {
+		if (ld->ops->flags & LDISC_FLAG_NOWAIT) // io_uring 先用 IOCB_NOWAIT 尝试, 返回 -EAGAIN 时再挂到 read_wait/write_wait 上
+			filp->f_mode |= FMODE_NOWAIT;
+		tty_ldisc_deref(ld);
+	}
+	tty_unlock(tty);
+	return 0;
+}
+
+/**
+ *	__tty_hangup		-	actual handler for hangup events
+ *	@tty: tty device
+ *	@exit_session: if non-zero, signal all foreground group processes
+ *
+ *	Locking:
+ *		BTM
+ *		  redirect lock for undoing redirection
+ *		  tty->files_lock for walking the tty's open files
+ *		  tty->ctrl_lock to clear session and pgrp
+ *
+ *	Only locks of this tty are taken (plus the redirect lock, which is
+ *	only held to compare one pointer), so hangups of different ttys do
+ *	not serialize against each other or against open/close elsewhere.
+ */
+static void __tty_hangup(struct tty_struct *tty, int exit_session)
+{
+	struct file *cons_filp = NULL;
+	struct file *filp, *f = NULL;
+	struct tty_file_private *priv;
+	int    closecount = 0, n;
+	int refs;
+
+	if (!tty)
+		return;
+
+	spin_lock(&redirect_lock);
+	if (redirect && file_tty(redirect) == tty) {
+		f = redirect;
+		redirect = NULL;
+	}
+	spin_unlock(&redirect_lock);
+
+	tty_lock(tty);
+
+	if (test_bit(TTY_HUPPED, &tty->flags)) {
+		tty_unlock(tty);
+		return;
+	}
+
+	/* inuse_filps is protected by the single tty lock,
+	   this really needs to change if we want to flush the
+	   workqueue with the lock held */
+	check_tty_count(tty, "tty_hangup");
+
+	spin_lock(&tty->files_lock); // 原来是全局的 tty_files_lock, 批量挂断时所有 tty 都要抢这一把锁
+	/* This breaks for file handles being sent over AF_UNIX sockets ? */
+	list_for_each_entry(priv, &tty->tty_files, list) {
+		filp = priv->file;
+		if (filp->f_op->write == redirected_tty_write)
+			cons_filp = filp;
+		if (filp->f_op->write_iter != tty_write_iter)
+			continue;
+		closecount++;
+		__tty_fasync(-1, filp, 0);	/* can't block */
+		filp->f_op = &hung_up_tty_fops;
+	}
+	spin_unlock(&tty->files_lock);
+
+	refs = tty_signal_session_leader(tty, exit_session);
+	/* Account for the p->signal references we killed */
+	while (refs--)
+		tty_kref_put(tty);
+
+	tty_ldisc_hangup(tty, cons_filp != NULL); // 新的线路规程从 tty->ldisc_slot[] 中取, 不再 kmalloc
+
+	spin_lock_irq(&tty->ctrl_lock);
+	clear_bit(TTY_THROTTLED, &tty->flags);
+	clear_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+	put_pid(tty->session);
+	put_pid(tty->pgrp);
+	tty->session = NULL;
+	tty->pgrp = NULL;
+	tty->ctrl_status = 0;
+	spin_unlock_irq(&tty->ctrl_lock);
+
+	/*
+	 * If one of the devices matches a console pointer, we
+	 * cannot just call hangup() because that will cause
+	 * tty->count and state->count to go out of sync.
+	 * So we just call close() the right number of times.
+	 */
+	if (cons_filp) {
+		if (tty->ops->close)
+			for (n = 0; n < closecount; n++)
+				tty->ops->close(tty, cons_filp);
+	} else if (tty->ops->hangup)
+		tty->ops->hangup(tty); // uart 一页的 xmit 环形缓冲区经 driver->xmit_pool 回收, 见 uart_xmit_buf_free()
+	/*
+	 * We don't want to have driver/ldisc interactions beyond the ones
+	 * we did here. The driver layer expects no calls after ->hangup()
+	 * from the ldisc side, which is now guaranteed.
+	 */
+	set_bit(TTY_HUPPED, &tty->flags);
+	tty_unlock(tty);
+
+	if (f)
+		fput(f);
+}
+
+/*
+ * Pending hangups. tty_hangup() can be called from interrupt context
+ * (carrier loss) and, when a container host tears down its sessions, for
+ * thousands of ptys at once. Instead of one work item per tty they are
+ * pushed on a lockless list of the calling cpu, and that cpu's work item
+ * hangs them up in a batch, one tty lock at a time. The work items run
+ * on system_unbound_wq, so up to one batch per cpu runs in parallel and
+ * a __tty_hangup() that blocks (a driver's ->hangup() waiting for its
+ * hardware) only holds up the ttys queued behind it on the same list.
+ */
+struct tty_hangup_batch {
+	struct llist_head list;
+	struct work_struct work;
+};
+static DEFINE_PER_CPU(struct tty_hangup_batch, tty_hangup_batches);
+
+static void tty_hangup_batch(struct work_struct *work)
+{
+	struct tty_hangup_batch *batch = container_of(work, struct tty_hangup_batch, work);
+	struct llist_node *list = llist_del_all(&batch->list);
+	struct tty_struct *tty, *next;
+
+	list = llist_reverse_order(list); // 按 tty_hangup() 的调用顺序处理
+	llist_for_each_entry_safe(tty, next, list, hangup_node) {
+		set_bit(TTY_HANGUP_RUNNING, &tty->flags); // 先置位再清 QUEUED, tty_flush_works() 不会看到两位都为 0
+		clear_bit(TTY_HANGUP_QUEUED, &tty->flags); // 在 __tty_hangup() 之前清除, 处理期间的新请求重新排队
+		__tty_hangup(tty, 0);
+		clear_bit_unlock(TTY_HANGUP_RUNNING, &tty->flags);
+		smp_mb__after_atomic();
+		wake_up_var(&tty->flags);
+		tty_kref_put(tty); // tty_hangup() 中获取的引用
+		cond_resched();
+	}
+}
+
+static bool tty_hangup_pending(struct tty_struct *tty)
+{
+	return READ_ONCE(tty->flags) & (BIT(TTY_HANGUP_QUEUED) | BIT(TTY_HANGUP_RUNNING));
+}
+
+/**
+ *	tty_hangup		-	trigger a hangup event
+ *	@tty: tty to hangup
+ *
+ *	A carrier loss (virtual or otherwise) has occurred on this like
+ *	schedule a hangup sequence to run after this event.
+ */
+void tty_hangup(struct tty_struct *tty)
+{
+	struct tty_hangup_batch *batch;
+
+	tty_debug_hangup(tty, "hangup\n");
+	if (test_and_set_bit(TTY_HANGUP_QUEUED, &tty->flags)) // 已经在某个 cpu 的链表上
+		return;
+	tty_kref_get(tty); // 保证 tty_hangup_batch() 处理时 tty 还在
+	batch = raw_cpu_ptr(&tty_hangup_batches); // 中途迁移到别的 cpu 也没关系, llist_add() 是原子的
+	if (llist_add(&tty->hangup_node, &batch->list)) // 链表原来为空才需要调度
+		queue_work(system_unbound_wq, &batch->work);
+}
+EXPORT_SYMBOL(tty_hangup);
+
+/*
+ * Called from release_tty() in place of flush_work(&tty->hangup_work):
+ * wait until a hangup of this tty (and of its link) that is queued or
+ * running has completed. Hangups of other ttys in the same batch are
+ * not waited for, so releasing one pty does not stall behind a mass
+ * hangup.
+ */
+static void tty_flush_works(struct tty_struct *tty)
+{
+	flush_work(&tty->SAK_work);
+	if (tty->link)
+		flush_work(&tty->link->SAK_work);
+	wait_var_event(&tty->flags, !tty_hangup_pending(tty)); // 原来是 flush_work(&tty->hangup_work), 只等这个 tty
+	if (tty->link)
+		wait_var_event(&tty->link->flags, !tty_hangup_pending(tty->link));
+}
+
+/**
+ *	tty_xmit_pool_create	-	create a per-driver xmit_buf pool
+ *	@per_node: pages to keep cached on each NUMA node
+ *
+ *	Drivers whose ports are opened and closed all the time (serial
+ *	multiplexers) set driver->xmit_pool to the result before
+ *	tty_register_driver(). Every port linked to the driver then recycles
+ *	its xmit_buf through the pool instead of the page allocator. Serial
+ *	core does this for every uart_driver, for its one page xmit rings.
+ *	destruct_tty_driver() destroys the pool.
+ */
+struct tty_xmit_pool *tty_xmit_pool_create(unsigned int per_node)
+{
+	struct tty_xmit_pool *pool;
+	int nid;
+
+	pool = kzalloc(struct_size(pool, node, nr_node_ids), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->max = per_node;
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		spin_lock_init(&pool->node[nid].lock);
+		INIT_LIST_HEAD(&pool->node[nid].pages);
+	}
+	return pool;
+}
+
+void tty_xmit_pool_destroy(struct tty_xmit_pool *pool)
+{
+	struct page *page, *tmp;
+	int nid;
+
+	if (!pool)
+		return;
+	for (nid = 0; nid < nr_node_ids; nid++)
+		list_for_each_entry_safe(page, tmp, &pool->node[nid].pages, lru)
+			__free_page(page);
+	kfree(pool);
+}
+
+static struct page *tty_xmit_pool_get(struct tty_xmit_pool *pool, int nid)
+{
+	struct tty_xmit_pool_node *pn = &pool->node[nid];
+	struct page *page;
+
+	spin_lock(&pn->lock);
+	page = list_first_entry_or_null(&pn->pages, struct page, lru);
+	if (page) {
+		list_del(&page->lru);
+		pn->count--;
+	}
+	spin_unlock(&pn->lock);
+	return page;
+}
+
+/* Returns false if the node's list is full and the page must be freed */
+static bool tty_xmit_pool_put(struct tty_xmit_pool *pool, struct page *page)
+{
+	struct tty_xmit_pool_node *pn = &pool->node[page_to_nid(page)]; // 还回页面所在的 node, 而不是当前 cpu 所在的 node
+	bool kept = false;
+
+	spin_lock(&pn->lock);
+	if (pn->count < pool->max) {
+		list_add(&page->lru, &pn->pages);
+		pn->count++;
+		kept = true;
+	}
+	spin_unlock(&pn->lock);
+	return kept;
+}
+
+/**
+ *	tty_xmit_pool_alloc_page	-	get a zeroed transmit page
+ *	@pool: the driver's pool, may be NULL
+ *	@nid: NUMA node, NUMA_NO_NODE for the local one
+ *
+ *	Taken from @pool when it has a page on @nid, else from the page
+ *	allocator on @nid. May sleep.
+ */
+struct page *tty_xmit_pool_alloc_page(struct tty_xmit_pool *pool, int nid)
+{
+	struct page *page = NULL;
+
+	if (nid == NUMA_NO_NODE)
+		nid = numa_node_id();
+
+	if (pool) {
+		page = tty_xmit_pool_get(pool, nid);
+		if (page) {
+			atomic_long_inc(&pool->reused);
+			clear_page(page_address(page)); // 原来用的是 get_zeroed_page(), 保持内容为 0
+			return page;
+		}
+	}
+	page = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO, 0); // 在中断所在的 node 上申请
+	if (page && pool)
+		atomic_long_inc(&pool->allocated);
+	return page;
+}
+EXPORT_SYMBOL_GPL(tty_xmit_pool_alloc_page);
+
+/* Back to @pool (may be NULL) unless its list for the page's node is full */
+void tty_xmit_pool_free_page(struct tty_xmit_pool *pool, struct page *page)
+{
+	if (!pool || !tty_xmit_pool_put(pool, page)) // 池子满了才真正释放
+		__free_page(page);
+}
+EXPORT_SYMBOL_GPL(tty_xmit_pool_free_page);
+
+/**
+ *	tty_port_alloc_xmit_buf	-	allocate the optional transmit page
+ *	@port: tty port
+ *
+ *	The page is taken from the driver's pool when it has one, on the
+ *	port's NUMA node (port->node, set by the driver from its irq
+ *	affinity, NUMA_NO_NODE for don't care).
+ */
+int tty_port_alloc_xmit_buf(struct tty_port *port)
+{
+	struct page *page;
+
+	/* We may sleep in alloc_pages_node() */
+	mutex_lock(&port->buf_mutex);
+	if (!port->xmit_buf) {
+		page = tty_xmit_pool_alloc_page(port->xmit_pool, port->node);
+		if (page)
+			port->xmit_buf = page_address(page);
+	}
+	mutex_unlock(&port->buf_mutex);
+	if (port->xmit_buf == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void tty_port_free_xmit_buf(struct tty_port *port)
+{
+	mutex_lock(&port->buf_mutex);
+	if (port->xmit_buf != NULL) {
+		tty_xmit_pool_free_page(port->xmit_pool, virt_to_page(port->xmit_buf));
+		port->xmit_buf = NULL;
+	}
+	mutex_unlock(&port->buf_mutex);
+}
+
+/**
+ *	tty_port_link_device - link tty and tty_port
+ *	@port: tty_port of the device
+ *	@driver: tty_driver for this device
+ *	@index: index of the tty
+ *
+ *	Provide the tty layer with a link from a tty (specified by @index) to a
+ *	tty_port (@port). Also picks up the driver's xmit_buf pool.
+ */
+void tty_port_link_device(struct tty_port *port, struct tty_driver *driver, unsigned index)
+{
+	if (WARN_ON(index >= driver->num))
+		return;
+	driver->ports[index] = port;
+	port->xmit_pool = driver->xmit_pool;
+}
+
 /**
  *	tty_driver_install_tty() - install a tty entry in the driver
  *	@driver: the driver for the tty
@@ -177,8 +924,12 @@ void tty_ldisc_init(struct tty_struct *tty)
  *	Returns a pointer to the discipline and bumps the ref count if it is
  *	available
  *
+ *	The tty_ldisc wrapper normally lives in tty->ldisc_slot[], so an open
+ *	or an ldisc switch does not allocate. Only when both slots are busy
+ *	(a switch that had to restore the old ldisc) is one kmalloc'ed.
+ *
  *	Locking:
- *		takes tty_ldiscs_lock to guard against ldisc races
+ *		none, get_ldops() reads tty_ldiscs[] under RCU
  */
 
 static struct tty_ldisc *tty_ldisc_get(struct tty_struct *tty, int disc)
@@ -201,7 +952,9 @@ static struct tty_ldisc *tty_ldisc_get(struct tty_struct *tty, int disc)
 			return ERR_CAST(ldops);
 	}
 
-	ld = kmalloc(sizeof(struct tty_ldisc), GFP_KERNEL); // 申请一个线路规程
+	ld = tty_ldisc_slot(tty); // 优先使用 tty_struct 中内嵌的空闲 tty_ldisc, 不需要申请内存
+	if (!ld)
+		ld = kmalloc(sizeof(struct tty_ldisc), GFP_KERNEL); // 两个内嵌的都在使用中才申请一个线路规程
 	if (ld == NULL) {
 		put_ldops(ldops);
 		return ERR_PTR(-ENOMEM);
@@ -213,24 +966,366 @@ static struct tty_ldisc *tty_ldisc_get(struct tty_struct *tty, int disc)
 	return ld;
 }
 
+/*
+ * Claim a free embedded tty_ldisc of @tty, or return NULL if both are in
+ * use. Two slots are enough for the old and the new ldisc to coexist
+ * during tty_set_ldisc(). tty_set_ldisc() gets the new ldisc before it
+ * takes ldisc_sem and may race with a hangup reinstating N_TTY, so a
+ * slot is claimed with an atomic bit rather than by testing ->ops.
+ */
+static struct tty_ldisc *tty_ldisc_slot(struct tty_struct *tty)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tty->ldisc_slot); i++)
+		if (!test_and_set_bit_lock(i, &tty->ldisc_slot_used))
+			return &tty->ldisc_slot[i];
+	return NULL;
+}
+
+/**
+ *	tty_ldisc_put		-	release the ldisc
+ *	@ld: ldisc to release
+ *
+ *	Complement of tty_ldisc_get().
+ */
+static void tty_ldisc_put(struct tty_ldisc *ld)
+{
+	struct tty_struct *tty;
+
+	if (WARN_ON_ONCE(!ld))
+		return;
+
+	tty = ld->tty;
+	put_ldops(ld->ops);
+	if (ld >= tty->ldisc_slot && ld < tty->ldisc_slot + ARRAY_SIZE(tty->ldisc_slot)) {
+		ld->ops = NULL;
+		clear_bit_unlock(ld - tty->ldisc_slot, &tty->ldisc_slot_used); // 内嵌的 tty_ldisc, 清除占用位表示该槽位空闲
+	} else
+		kfree(ld);
+}
+
+/*
+ * tty_ldiscs[] is only written under tty_ldiscs_lock by
+ * tty_register_ldisc()/tty_unregister_ldisc() and read under RCU. The
+ * per-ldisc refcount is a per-cpu counter, so concurrent opens on many
+ * cores do not bounce a shared cacheline; only tty_unregister_ldisc()
+ * sums it up.
+ */
 static struct tty_ldisc_ops *get_ldops(int disc)
 {
-	unsigned long flags;
 	struct tty_ldisc_ops *ldops, *ret;
 
-	raw_spin_lock_irqsave(&tty_ldiscs_lock, flags);
+	rcu_read_lock(); // 原来这里是 raw_spin_lock_irqsave(&tty_ldiscs_lock, flags), 所有 cpu 上的 open 都会争抢这把锁
 	ret = ERR_PTR(-EINVAL);
-	ldops = tty_ldiscs[disc]; // 从全局数组获取线路规程函数集
+	ldops = rcu_dereference(tty_ldiscs[disc]); // 从全局数组获取线路规程函数集
 	if (ldops) {
 		ret = ERR_PTR(-EAGAIN);
 		if (try_module_get(ldops->owner)) {
-			ldops->refcount++;
+			this_cpu_inc(*ldops->refcount);
 			ret = ldops;
 		}
 	}
+	rcu_read_unlock();
+	return ret;
+}
+
+static void put_ldops(struct tty_ldisc_ops *ldops)
+{
+	this_cpu_dec(*ldops->refcount); // 在别的 cpu 上减, 单个 cpu 的值可能为负, 求和后才有意义
+	module_put(ldops->owner);
+}
+
+int tty_register_ldisc(int disc, struct tty_ldisc_ops *new_ldisc)
+{
+	unsigned long flags;
+
+	if (disc < N_TTY || disc >= NR_LDISCS)
+		return -EINVAL;
+
+	new_ldisc->refcount = alloc_percpu(int);
+	if (!new_ldisc->refcount)
+		return -ENOMEM;
+
+	raw_spin_lock_irqsave(&tty_ldiscs_lock, flags);
+	new_ldisc->num = disc;
+	rcu_assign_pointer(tty_ldiscs[disc], new_ldisc); // 发布给 get_ldops() 中的 RCU 读者
 	raw_spin_unlock_irqrestore(&tty_ldiscs_lock, flags);
+
+	return 0;
+}
+
+static int tty_ldisc_refs(struct tty_ldisc_ops *ldops)
+{
+	int cpu, refs = 0;
+
+	for_each_possible_cpu(cpu)
+		refs += *per_cpu_ptr(ldops->refcount, cpu);
+	return refs;
+}
+
+int tty_unregister_ldisc(int disc)
+{
+	unsigned long flags;
+	struct tty_ldisc_ops *ldops;
+
+	if (disc < N_TTY || disc >= NR_LDISCS)
+		return -EINVAL;
+
+	raw_spin_lock_irqsave(&tty_ldiscs_lock, flags);
+	ldops = rcu_dereference_protected(tty_ldiscs[disc], lockdep_is_held(&tty_ldiscs_lock));
+	if (ldops && tty_ldisc_refs(ldops)) { // 还有 tty 在使用: 直接返回, 查找不受影响
+		raw_spin_unlock_irqrestore(&tty_ldiscs_lock, flags);
+		return -EBUSY;
+	}
+	RCU_INIT_POINTER(tty_ldiscs[disc], NULL);
+	raw_spin_unlock_irqrestore(&tty_ldiscs_lock, flags);
+	if (!ldops)
+		return 0;
+
+	synchronize_rcu(); // 此后不会再有 get_ldops() 拿到 ldops, 引用计数只会减少
+
+	if (tty_ldisc_refs(ldops)) { // 宽限期内有 get_ldops() 抢到了引用, 在返回错误之前放回去
+		raw_spin_lock_irqsave(&tty_ldiscs_lock, flags);
+		if (!rcu_access_pointer(tty_ldiscs[disc]))
+			rcu_assign_pointer(tty_ldiscs[disc], ldops);
+		raw_spin_unlock_irqrestore(&tty_ldiscs_lock, flags);
+		return -EBUSY;
+	}
+
+	free_percpu(ldops->refcount);
+	return 0;
+}
+
+/*
+ * Line disciplines pinned by tty_ldisc_pin(). Each entry holds one
+ * get_ldops() reference, so the module stays loaded and tty_ldisc_get()
+ * never has to go through request_module() for it.
+ */
+static struct tty_ldisc_ops *tty_ldiscs_pinned[NR_LDISCS];
+static DEFINE_MUTEX(tty_ldiscs_pin_mutex);
+
+/**
+ *	tty_ldisc_pin		-	preload and pin a line discipline
+ *	@disc: ldisc number
+ *
+ *	Load the module providing @disc if needed and keep it loaded until
+ *	tty_ldisc_unpin(). Meant to be called once before switching many
+ *	ports to the same protocol ldisc (SLIP, PPP, HCI ...), so the
+ *	switches themselves do not each wait for modprobe.
+ */
+int tty_ldisc_pin(int disc)
+{
+	struct tty_ldisc_ops *ldops;
+	int ret = 0;
+
+	if (disc < N_TTY || disc >= NR_LDISCS)
+		return -EINVAL;
+
+	mutex_lock(&tty_ldiscs_pin_mutex);
+	if (tty_ldiscs_pinned[disc]) // 已经被 pin 住了
+		goto out;
+
+	ldops = get_ldops(disc);
+	if (IS_ERR(ldops)) {
+		request_module("tty-ldisc-%d", disc);
+		ldops = get_ldops(disc);
+	}
+	if (IS_ERR(ldops))
+		ret = PTR_ERR(ldops);
+	else
+		tty_ldiscs_pinned[disc] = ldops; // 持有这个引用, 模块不会被卸载
+out:
+	mutex_unlock(&tty_ldiscs_pin_mutex);
 	return ret;
 }
+EXPORT_SYMBOL_GPL(tty_ldisc_pin);
+
+void tty_ldisc_unpin(int disc)
+{
+	if (disc < N_TTY || disc >= NR_LDISCS)
+		return;
+
+	mutex_lock(&tty_ldiscs_pin_mutex);
+	if (tty_ldiscs_pinned[disc]) {
+		put_ldops(tty_ldiscs_pinned[disc]);
+		tty_ldiscs_pinned[disc] = NULL;
+	}
+	mutex_unlock(&tty_ldiscs_pin_mutex);
+}
+EXPORT_SYMBOL_GPL(tty_ldisc_unpin);
+
+/*
+ * Move the bytes @ld received but nobody read yet back to the port's
+ * flip buffers, ahead of anything still queued there, so the next ldisc
+ * gets them in order. Called from tty_set_ldisc() with the ldisc locked
+ * and flush_to_ldisc() halted; only the consumer end (buf->head) is
+ * touched, under buf->lock, so the driver may keep pushing at the tail.
+ */
+static void tty_ldisc_requeue_unread(struct tty_struct *tty, struct tty_ldisc *ld)
+{
+	struct tty_port *port = tty->port;
+	struct tty_bufhead *buf;
+	struct tty_buffer *b;
+	int n;
+
+	if (!port || !ld->ops->take_unread)
+		return;
+	buf = &port->buf;
+
+	b = tty_buffer_alloc(port, N_TTY_BUF_SIZE);
+	if (!b)
+		return; // 申请失败时和原来一样, 这些数据随旧的线路规程一起丢掉
+	n = ld->ops->take_unread(tty, char_buf_ptr(b, 0), b->size);
+	if (n <= 0) {
+		tty_buffer_free(port, b);
+		return;
+	}
+	b->used = n;
+	b->flags = TTYB_NORMAL; // 没有 flag 字节
+	smp_store_release(&b->commit, n);
+
+	mutex_lock(&buf->lock);
+	b->next = buf->head;
+	buf->head = b;
+	mutex_unlock(&buf->lock);
+}
+
+/**
+ *	tty_buffer_flush		-	flush full tty buffers
+ *	@tty: tty to flush
+ *	@ld:  optional ldisc ptr (must be referenced)
+ *
+ *	flush all the buffers containing receive data. If ld != NULL,
+ *	flush the ldisc input buffer.
+ *
+ *	While tty_set_ldisc() opens a new ldisc (TTY_LDISC_SWITCHING) the
+ *	flip buffers are kept, they hold the data being handed over.
+ *
+ *	Locking: takes buffer lock to ensure single-threaded flip buffer
+ *		 'consumer'
+ */
+void tty_buffer_flush(struct tty_struct *tty, struct tty_ldisc *ld)
+{
+	struct tty_port *port = tty->port;
+	struct tty_bufhead *buf = &port->buf;
+	struct tty_buffer *next;
+
+	atomic_inc(&buf->priority);
+
+	mutex_lock(&buf->lock);
+	if (test_bit(TTY_LDISC_SWITCHING, &tty->flags))
+		goto flush_ldisc;
+	/* paired w/ release in __tty_buffer_request_room; ensures there are
+	 * no pending memory accesses to the freed buffer
+	 */
+	while ((next = smp_load_acquire(&buf->head->next)) != NULL) {
+		tty_buffer_free(port, buf->head);
+		buf->head = next;
+	}
+	buf->head->read = buf->head->commit;
+
+flush_ldisc:
+	if (ld && ld->ops->flush_buffer)
+		ld->ops->flush_buffer(tty);
+
+	atomic_dec(&buf->priority);
+	mutex_unlock(&buf->lock);
+}
+
+/**
+ *	tty_set_ldisc		-	set line discipline
+ *	@tty: the terminal to set
+ *	@disc: the line discipline number
+ *
+ *	Set the discipline of a tty line. Must be called from a process
+ *	context. The ldisc change logic has to protect itself against any
+ *	overlapping ldisc change (including on the other end of pty pairs),
+ *	the close of one side of a tty/pty pair, and eventually hangup.
+ *
+ *	No received data is lost across the switch:
+ *	 - bytes the old ldisc holds but nobody has read (N_TTY's read_buf)
+ *	   are moved back to the head of the port's tty_buffer chain;
+ *	 - flush_to_ldisc() is halted, not flushed, while the ldiscs are
+ *	   swapped, and a tty_ldisc_flush() from the new ldisc's open() (SLIP,
+ *	   HCI ... do that) leaves the chain alone (TTY_LDISC_SWITCHING);
+ *	 - the work is restarted at the end, so everything queued is handed
+ *	   to the new discipline even if no new characters arrive.
+ *	Pinned ldiscs (tty_ldisc_pin()) never wait for request_module().
+ */
+int tty_set_ldisc(struct tty_struct *tty, int disc)
+{
+	int retval;
+	struct tty_ldisc *old_ldisc, *new_ldisc;
+
+	new_ldisc = tty_ldisc_get(tty, disc); // 在拿 ldisc_sem 之前获取新的线路规程, 已被 pin 的线路规程不会走 request_module()
+	if (IS_ERR(new_ldisc))
+		return PTR_ERR(new_ldisc);
+
+	tty_lock(tty);
+	retval = tty_ldisc_lock(tty, 5 * HZ); // 设置 TTY_LDISC_HALTED, flush_to_ldisc() 暂停, 但 tty_buffer 中的数据保留
+	if (retval)
+		goto err;
+
+	if (!tty->ldisc) {
+		retval = -EIO;
+		goto out;
+	}
+
+	/* Check the no-op case */
+	if (tty->ldisc->ops->num == disc)
+		goto out;
+
+	if (test_bit(TTY_HUPPED, &tty->flags)) {
+		/* We were raced by hangup */
+		retval = -EIO;
+		goto out;
+	}
+
+	old_ldisc = tty->ldisc;
+
+	/* Keep what the old discipline received but nobody read */
+	tty_ldisc_requeue_unread(tty, old_ldisc);
+
+	/* Shutdown the old discipline. */
+	tty_ldisc_close(tty, old_ldisc);
+
+	/* Now set up the new line discipline. */
+	tty->ldisc = new_ldisc;
+	tty_set_termios_ldisc(tty, disc);
+
+	set_bit(TTY_LDISC_SWITCHING, &tty->flags); // 新线路规程 open() 中的 tty_ldisc_flush() 不丢弃 tty_buffer
+	retval = tty_ldisc_open(tty, new_ldisc);
+	clear_bit(TTY_LDISC_SWITCHING, &tty->flags);
+	if (retval < 0) {
+		/* Back to the old one or N_TTY if we can't */
+		tty_ldisc_put(new_ldisc);
+		tty_ldisc_restore(tty, old_ldisc);
+	}
+
+	if (tty->ldisc->ops->num != old_ldisc->ops->num && tty->ops->set_ldisc) {
+		down_read(&tty->termios_rwsem);
+		tty->ops->set_ldisc(tty);
+		up_read(&tty->termios_rwsem);
+	}
+
+	/* At this point we hold a reference to the new ldisc and a
+	   reference to the old ldisc, or we hold two references to
+	   the old ldisc (if it was restored as part of error cleanup
+	   above). In either case, releasing a single reference from
+	   the old ldisc is correct. */
+	new_ldisc = old_ldisc;
+out:
+	tty_ldisc_unlock(tty);
+
+	/* Restart the work queue so the data still queued in the tty_buffer
+	   chain reaches the new ldisc even if no new characters kick it off */
+	tty_buffer_restart_work(tty->port); // 切换期间积压的数据交给新的线路规程, 而不是丢掉
+err:
+	tty_ldisc_put(new_ldisc);	/* drop the extra reference */
+	tty_unlock(tty);
+	return retval;
+}
 /**
  *	tty_ldisc_setup			-	open line discipline
  *	@tty: tty being shut down
@@ -285,6 +1380,195 @@ static int tty_ldisc_open(struct tty_struct *tty, struct tty_ldisc *ld)
 	return 0;
 }
 
+/*
+ * ld_semaphore, per-cpu reader counts. The read side is taken for every
+ * tty_ldisc_ref(), i.e. on each read, write, ioctl and flush_to_ldisc()
+ * pass; a shared atomic count made all of them bounce one cacheline
+ * between the cpus. Readers now only inc/dec their cpu's read_count and
+ * check block, with a full barrier in between (A/B below, a Dekker
+ * pair): either the writer sees the reader's count or the reader sees
+ * block. No RCU grace period is involved, so a writer (tty_set_ldisc(),
+ * hangup) costs a sum over the cpus and is bounded by its timeout.
+ *
+ * Wakeups only go one way: blocked readers sleep on readers_wait and are
+ * woken by the writer releasing block; the writer sleeps on writer_wait
+ * and is woken by readers dropping their count.
+ */
+int __init_ldsem(struct ld_semaphore *sem, const char *name, struct lock_class_key *key)
+{
+#ifdef CONFIG_DEBUG_LOCK_ALLOC
+	/*
+	 * Make sure we are not reinitializing a held semaphore:
+	 */
+	debug_check_no_locks_freed((void *)sem, sizeof(*sem));
+	lockdep_init_map(&sem->dep_map, name, key, 0);
+#endif
+	sem->read_count = alloc_percpu(unsigned int);
+	if (!sem->read_count)
+		return -ENOMEM;
+	atomic_set(&sem->block, 0);
+	init_waitqueue_head(&sem->readers_wait);
+	init_waitqueue_head(&sem->writer_wait);
+	return 0;
+}
+
+void ldsem_free(struct ld_semaphore *sem)
+{
+	free_percpu(sem->read_count);
+	sem->read_count = NULL;
+}
+
+static bool __ldsem_read_trylock(struct ld_semaphore *sem)
+{
+	this_cpu_inc(*sem->read_count);
+
+	/*
+	 * A: pairs with B in __ldsem_down_write(): either the writer sees
+	 * our count, or we see its block.
+	 */
+	smp_mb();
+	if (likely(!atomic_read_acquire(&sem->block)))
+		return true;
+
+	this_cpu_dec(*sem->read_count);
+	smp_mb(); /* the dec before the writer's next look at the counts */
+	wake_up(&sem->writer_wait); // 只唤醒写者, 它可能正在等读计数归零
+	return false;
+}
+
+static int __ldsem_down_read(struct ld_semaphore *sem, long timeout)
+{
+	while (!__ldsem_read_trylock(sem)) {
+		/* Woken only by the writer dropping block, see ldsem_up_write() */
+		timeout = wait_event_timeout(sem->readers_wait, !atomic_read(&sem->block), timeout);
+		if (!timeout)
+			return 0;
+	}
+	return 1;
+}
+
+static int __ldsem_down_read_nested(struct ld_semaphore *sem, int subclass, long timeout)
+{
+	int ret;
+
+	rwsem_acquire_read(&sem->dep_map, subclass, 0, _RET_IP_);
+	ret = __ldsem_down_read(sem, timeout);
+	if (!ret)
+		rwsem_release(&sem->dep_map, 1, _RET_IP_);
+	return ret;
+}
+
+/*
+ * lock for reading -- returns 1 if successful, 0 if timed out
+ */
+int __sched ldsem_down_read(struct ld_semaphore *sem, long timeout)
+{
+	might_sleep();
+	return __ldsem_down_read_nested(sem, 0, timeout);
+}
+
+/*
+ * trylock for reading -- returns 1 if successful, 0 if contention
+ */
+int ldsem_down_read_trylock(struct ld_semaphore *sem)
+{
+	if (!__ldsem_read_trylock(sem))
+		return 0;
+	rwsem_acquire_read(&sem->dep_map, 0, 1, _RET_IP_);
+	return 1;
+}
+
+/*
+ * release a read lock
+ */
+void ldsem_up_read(struct ld_semaphore *sem)
+{
+	rwsem_release(&sem->dep_map, 1, _RET_IP_);
+
+	smp_mb(); /* order the critical section before the dec */
+	this_cpu_dec(*sem->read_count); // 不写任何共享的 cacheline
+	smp_mb(); /* the dec before the block check, pairs with B */
+	if (unlikely(atomic_read(&sem->block)))
+		wake_up(&sem->writer_wait);
+}
+
+static bool ldsem_readers_active(struct ld_semaphore *sem)
+{
+	unsigned int sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu(*sem->read_count, cpu); // inc 和 dec 可能在不同 cpu 上, 只有总和有意义
+
+	if (sum)
+		return true;
+	smp_mb(); /* pairs with the barrier in ldsem_up_read() */
+	return false;
+}
+
+static int __ldsem_down_write(struct ld_semaphore *sem, long timeout)
+{
+	/* Other writers; readers_wait is only woken by ldsem_up_write() */
+	timeout = wait_event_timeout(sem->readers_wait, atomic_xchg(&sem->block, 1) == 0, timeout);
+	if (!timeout)
+		return 0;
+
+	smp_mb(); /* B: pairs with A in __ldsem_read_trylock() */
+
+	if (wait_event_timeout(sem->writer_wait, !ldsem_readers_active(sem), timeout))
+		return 1;
+
+	atomic_set_release(&sem->block, 0);
+	wake_up_all(&sem->readers_wait);
+	return 0;
+}
+
+static int __ldsem_down_write_nested(struct ld_semaphore *sem, int subclass, long timeout)
+{
+	int ret;
+
+	rwsem_acquire(&sem->dep_map, subclass, 0, _RET_IP_);
+	ret = __ldsem_down_write(sem, timeout);
+	if (!ret)
+		rwsem_release(&sem->dep_map, 1, _RET_IP_);
+	return ret;
+}
+
+/*
+ * lock for writing -- returns 1 if successful, 0 if timed out
+ */
+int __sched ldsem_down_write(struct ld_semaphore *sem, long timeout)
+{
+	might_sleep();
+	return __ldsem_down_write_nested(sem, 0, timeout);
+}
+
+/*
+ * release a write lock
+ */
+void ldsem_up_write(struct ld_semaphore *sem)
+{
+	rwsem_release(&sem->dep_map, 1, _RET_IP_);
+
+	atomic_set_release(&sem->block, 0);
+	wake_up_all(&sem->readers_wait); // 等待的读者和下一个写者
+}
+
+#ifdef CONFIG_DEBUG_LOCK_ALLOC
+int ldsem_down_read_nested(struct ld_semaphore *sem, int subclass, long timeout)
+{
+	might_sleep();
+	return __ldsem_down_read_nested(sem, subclass, timeout);
+}
+
+int ldsem_down_write_nested(struct ld_semaphore *sem, int subclass,
+			    long timeout)
+{
+	might_sleep();
+	return __ldsem_down_write_nested(sem, subclass, timeout);
+}
+#endif
+
 /**
  *	flush_to_ldisc
  *	@work: tty structure passed from work queue.
@@ -339,6 +1623,7 @@ static void flush_to_ldisc(struct work_struct *work)
 			continue;	// 继续刷新第二个缓冲区的数据
 		}
 
+		trace_tty_flush_to_ldisc(port, head->seq, head->read, count); // 关闭时是 nop
 		count = receive_buf(tty, head, count);
 		if (!count)
 			break;
@@ -348,6 +1633,371 @@ static void flush_to_ldisc(struct work_struct *work)
 
 	tty_ldisc_deref(disc);
 }
+/*
+ * Chunk size bounds for do_tty_write(). Writes start at the historical
+ * 2kB; each time the ldisc swallows a whole chunk the next one doubles,
+ * up to 64kB, and each time it takes only part of one the next one
+ * halves. Writes smaller than the chunk say nothing about it and leave
+ * it alone. A tty fed with large writes ends up making a few big ldisc
+ * calls instead of hundreds of 2kB ones.
+ *
+ * TTY_NO_WRITE_SPLIT ttys must see each write() whole, as far as
+ * possible: they always use the 1MB chunk and never adapt it.
+ */
+#define TTY_WRITE_CHUNK_MIN		2048
+#define TTY_WRITE_CHUNK_MAX		65536
+#define TTY_WRITE_CHUNK_NO_SPLIT	(1 << 20)
+
+/*
+ * Split writes up in sane blocksizes to avoid
+ * denial-of-service type attacks
+ */
+static inline ssize_t do_tty_write(
+	ssize_t (*write)(struct tty_struct *, struct file *, struct kiocb *, const unsigned char *, size_t),
+	struct tty_struct *tty,
+	struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	size_t count = iov_iter_count(from);
+	ssize_t ret, written = 0;
+	unsigned int chunk, limit;
+	bool no_split = test_bit(TTY_NO_WRITE_SPLIT, &tty->flags);
+
+	ret = tty_write_lock(tty, (file->f_flags & O_NDELAY) || nowait); // 锁被别的写者持有时 io_uring 得到 -EAGAIN
+	if (ret < 0)
+		return ret;
+
+	/*
+	 * We chunk up writes into a temporary buffer. This
+	 * simplifies low-level drivers immensely, since they
+	 * don't have locking issues and user mode accesses.
+	 */
+	if (no_split)
+		limit = TTY_WRITE_CHUNK_NO_SPLIT; // 固定最大块, 不参与调整
+	else
+		limit = clamp_t(unsigned int, tty->write_chunk, TTY_WRITE_CHUNK_MIN, TTY_WRITE_CHUNK_MAX); // 上一次调整后的块大小
+	chunk = limit;
+	if (count < chunk)
+		chunk = count;
+
+	/* write_buf/write_cnt is protected by the atomic_write_lock mutex */
+	if (tty->write_cnt < chunk) {
+		unsigned char *buf_chunk;
+
+		if (chunk < 1024)
+			chunk = 1024;
+
+		buf_chunk = kvmalloc(chunk, GFP_KERNEL); // 块可能比较大, kmalloc 失败时退回 vmalloc
+		if (!buf_chunk) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		kvfree(tty->write_buf);
+		tty->write_cnt = chunk;
+		tty->write_buf = buf_chunk;
+	}
+
+	/* Do the write .. */
+	for (;;) {
+		size_t size = min_t(size_t, count, chunk);
+
+		ret = -EFAULT;
+		if (copy_from_iter(tty->write_buf, size, from) != size) // 多个 iovec 会被合并到同一块, 一次交给线路规程
+			break;
+		ret = write(tty, file, iocb, tty->write_buf, size); // IOCB_NOWAIT 时线路规程只写驱动马上能接受的部分
+		if (ret <= 0)
+			break;
+
+		if (!no_split && size == limit) { // 只有这一块被 limit 截断时才说明 limit 合不合适
+			if (ret == size && limit < TTY_WRITE_CHUNK_MAX) // 整块都被接受, 下一次可以给更多
+				tty->write_chunk = min_t(unsigned int, limit * 2, TTY_WRITE_CHUNK_MAX);
+			else if (ret < size) // 线路规程接受不了这么多, 缩小
+				tty->write_chunk = max_t(unsigned int, limit / 2, TTY_WRITE_CHUNK_MIN);
+		}
+
+		if (ret != size) // 没写完的部分下一轮重新从 iov_iter 拷贝
+			iov_iter_revert(from, size - ret);
+
+		written += ret;
+		count -= ret;
+		if (!count)
+			break;
+		ret = -ERESTARTSYS;
+		if (signal_pending(current))
+			break;
+		cond_resched();
+	}
+	if (written) {
+		tty_update_time(&file_inode(file)->i_mtime);
+		ret = written;
+	}
+
+	/* The chunk has shrunk well below the buffer: give the memory back */
+	if (!no_split)
+		limit = clamp_t(unsigned int, tty->write_chunk, TTY_WRITE_CHUNK_MIN, TTY_WRITE_CHUNK_MAX);
+	if (tty->write_cnt > 2 * limit) { // 下一次写时按新的块大小重新申请
+		kvfree(tty->write_buf);
+		tty->write_buf = NULL;
+		tty->write_cnt = 0;
+	}
+out:
+	tty_write_unlock(tty);
+	return ret;
+}
+
+/**
+ *	tty_write_iter		-	write method for tty device file
+ *	@iocb: kernel I/O control block
+ *	@from: user data, one or more iovecs (write, writev, io_uring)
+ *
+ *	Write data to a tty device via the line discipline.
+ *
+ *	Locking:
+ *		Locks the line discipline as required
+ *		Writes to the tty driver are serialized by the atomic_write_lock
+ *	and are then processed in chunks to the device. The line discipline
+ *	write method will not be invoked in parallel for each device.
+ */
+static ssize_t tty_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct tty_struct *tty = file_tty(file);
+	struct tty_ldisc *ld;
+	ssize_t ret;
+
+	if (tty_paranoia_check(tty, file_inode(file), "tty_write"))
+		return -EIO;
+	if (!tty || !tty->ops->write || tty_io_error(tty))
+		return -EIO;
+	/* Short term debug to catch buggy drivers */
+	if (tty->ops->write_room == NULL)
+		tty_err(tty, "missing write_room method\n");
+	if (iocb->ki_flags & IOCB_NOWAIT) { // 线路规程正在切换时不等待, io_uring 会在 io-wq 中重试
+		ld = tty_ldisc_ref(tty);
+		if (!ld)
+			return -EAGAIN;
+	} else {
+		ld = tty_ldisc_ref_wait(tty);
+		if (!ld)
+			return hung_up_tty_write(file, NULL, 0, NULL);
+	}
+	if (!ld->ops->write)
+		ret = -EIO;
+	else if ((iocb->ki_flags & IOCB_NOWAIT) && !(ld->ops->flags & LDISC_FLAG_NOWAIT))
+		ret = -EAGAIN; // 打开之后换成了会睡眠的线路规程
+	else
+		ret = do_tty_write(ld->ops->write, tty, iocb, from);
+	tty_ldisc_deref(ld);
+	return ret;
+}
+
+/**
+ *	tty_read_iter		-	read method for tty device files
+ *	@iocb: kernel I/O control block
+ *	@to: destination, one or more iovecs
+ *
+ *	Perform the read system call function on this terminal device. Checks
+ *	for hung up devices before calling the line discipline method.
+ *
+ *	io_uring issues reads with IOCB_NOWAIT first (the file has
+ *	FMODE_NOWAIT if the ldisc supports it, see tty_open()). With no input available the ldisc
+ *	returns -EAGAIN instead of sleeping on read_wait, io_uring arms its
+ *	poll handler on read_wait and reissues the read from the EPOLLIN
+ *	wakeup of n_tty_receive_buf_common(). Multishot reads work the same
+ *	way, without one syscall per event.
+ *
+ *	Locking:
+ *		Locks the line discipline internally while needed. Multiple
+ *	read calls may be outstanding in parallel.
+ */
+static ssize_t tty_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct tty_struct *tty = file_tty(file);
+	struct tty_ldisc *ld;
+	ssize_t ret;
+
+	if (tty_paranoia_check(tty, inode, "tty_read"))
+		return -EIO;
+	if (!tty || tty_io_error(tty))
+		return -EIO;
+
+	/* We want to wait for the line discipline to sort out in this
+	   situation, unless the caller must not sleep. */
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		ld = tty_ldisc_ref(tty);
+		if (!ld)
+			return -EAGAIN;
+	} else {
+		ld = tty_ldisc_ref_wait(tty);
+		if (!ld)
+			return hung_up_tty_read(file, NULL, 0, NULL);
+	}
+	tty_buffer_note_reader(tty->port);
+	if (!ld->ops->read)
+		ret = -EIO;
+	else if ((iocb->ki_flags & IOCB_NOWAIT) && !(ld->ops->flags & LDISC_FLAG_NOWAIT))
+		ret = -EAGAIN; // 打开之后换成了会睡眠的线路规程
+	else
+		ret = ld->ops->read(tty, file, iocb, to); // n_tty_read() 拿到 iocb, 可以判断 IOCB_NOWAIT
+	tty_ldisc_deref(ld);
+
+	if (ret > 0)
+		tty_update_time(&inode->i_atime);
+
+	return ret;
+}
+
+static const struct file_operations tty_fops = {
+	.llseek		= no_llseek,
+	.read_iter	= tty_read_iter, // 原来是 .read = tty_read
+	.write_iter	= tty_write_iter, // 原来是 .write = tty_write
+	.splice_write	= iter_file_splice_write,
+	.poll		= tty_poll,
+	.unlocked_ioctl	= tty_ioctl,
+	.compat_ioctl	= tty_compat_ioctl,
+	.open		= tty_open, // 线路规程声明了 LDISC_FLAG_NOWAIT 时 tty_open() 设置 FMODE_NOWAIT, io_uring 才会先尝试非阻塞读写
+	.release	= tty_release,
+	.fasync		= tty_fasync,
+};
+
+/*
+ * Used by n_tty_read() in place of tty_io_nonblock(): a read must not
+ * sleep for O_NONBLOCK files and for IOCB_NOWAIT attempts from io_uring.
+ * Lives next to tty_io_nonblock() in <linux/tty.h>.
+ */
+static inline bool tty_read_nowait(struct tty_struct *tty, struct file *file, struct kiocb *iocb)
+{
+	return tty_io_nonblock(tty, file) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/*
+ * Raw-mode fast path of pty_write(): hand the bytes straight to the peer's
+ * ldisc instead of copying them into the peer's flip buffers and letting
+ * flush_to_ldisc() copy them again from a workqueue. Only taken when
+ *  - the peer's termios is raw (no echo, signals or canonical editing,
+ *    which could write back into this side from inside our write),
+ *  - no earlier data is still queued in the peer's flip buffers, so
+ *    ordering is preserved, and
+ *  - the peer's buffer lock is free, i.e. flush_to_ldisc() is not running.
+ * Returns the number of bytes the ldisc accepted; the caller queues the
+ * rest the normal way.
+ *
+ * The peer's termios is sampled under its termios_rwsem; the lock cannot
+ * be held across ->receive_buf2(), which takes it itself. If the peer
+ * turns echo on in between, the echo comes back through pty_write() on
+ * the peer; TTY_PTY_DIRECT on the peer sends that write through the
+ * flip buffers instead of recursing into this side's ldisc, whose
+ * termios_rwsem our own writer may be holding.
+ *
+ * pty_write() is also reached from contexts that must not sleep, e.g.
+ * tty_put_char() under a spinlock. Nothing here blocks: every lock is
+ * a trylock, and TTY_PTY_DIRECT makes n_tty take its termios_rwsem with
+ * a trylock too, returning 0 so the bytes go to the flip buffers. Other
+ * ldiscs make no such promise and are not fed directly, nor is anything
+ * from interrupt context, where mutex_trylock() is not allowed.
+ *
+ * The batch gets a seq of its own for the tty events. The peer's empty
+ * tail is renumbered past it, so tty_flip_trace_push() does not report
+ * the batch again as a sealed buffer.
+ */
+static int pty_write_direct(struct tty_struct *to, const unsigned char *buf, int c)
+{
+	struct tty_bufhead *bh = &to->port->buf;
+	struct tty_ldisc *ld;
+	unsigned long flags;
+	bool idle, raw;
+	u32 seq = 0;
+	int n = 0;
+
+	if (in_interrupt())
+		return 0;
+
+	if (test_bit(TTY_PTY_DIRECT, &to->link->flags)) // 对端正在往本端的 ldisc 直接写, 这是它的回显
+		return 0;
+
+	if (!down_read_trylock(&to->termios_rwsem)) // 对端正在修改 termios, 走 flip 缓冲区
+		return 0;
+	raw = !(L_ICANON(to) || L_ECHO(to) || L_ISIG(to) || I_IXON(to));
+	up_read(&to->termios_rwsem);
+	if (!raw)
+		return 0;
+
+	if (!mutex_trylock(&bh->lock)) // 对端的 flush_to_ldisc() 正在运行
+		return 0;
+
+	spin_lock_irqsave(&to->port->lock, flags);
+	idle = bh->head->commit == bh->head->read && !bh->head->next; // flip 缓冲区中没有积压的数据
+	if (idle) { // 这批数据单独占一个 seq, 空的 tail 换成下一个 seq
+		seq = bh->seq + 1;
+		bh->tail->seq = seq + 1;
+		WRITE_ONCE(bh->seq, seq + 1);
+		bh->push_seq = bh->tail->seq;
+		bh->push_off = bh->tail->used;
+	}
+	spin_unlock_irqrestore(&to->port->lock, flags);
+	if (!idle)
+		goto out;
+
+	ld = tty_ldisc_ref(to);
+	if (!ld)
+		goto out;
+	if (ld->ops->num == N_TTY && ld->ops->receive_buf2) { // 只有 n_tty 在 TTY_PTY_DIRECT 下不睡眠
+		trace_tty_flip_push(to->port, seq, 0, c);
+		trace_tty_flush_to_ldisc(to->port, seq, 0, c);
+		if (trace_n_tty_receive_enabled()) {
+			bh->rx_seq = seq;
+			bh->rx_off = 0;
+		}
+		set_bit(TTY_PTY_DIRECT, &to->flags);
+		n = ld->ops->receive_buf2(to, buf, NULL, c); // 直接拷贝到对端 n_tty 的 read_buf, 少一次拷贝和一次工作队列调度
+		clear_bit(TTY_PTY_DIRECT, &to->flags);
+	}
+	tty_ldisc_deref(ld);
+out:
+	mutex_unlock(&bh->lock);
+	return n;
+}
+
+/**
+ *	pty_write		-	write to a pty
+ *	@tty: the tty we write from
+ *	@buf: kernel buffer of data
+ *	@c: bytes to write
+ *
+ *	Our "hardware" write method. Data is coming from the ldisc which
+ *	may be in a non sleeping state. We simply throw this at the other
+ *	end of the link as if we were an IRQ handler receiving stuff for
+ *	the other side of the pty/tty pair.
+ */
+static int pty_write(struct tty_struct *tty, const unsigned char *buf, int c)
+{
+	struct tty_struct *to = tty->link;
+	unsigned long flags;
+	int done;
+
+	if (tty->stopped)
+		return 0;
+
+	if (c <= 0)
+		return c;
+
+	done = pty_write_direct(to, buf, c);
+	if (done == c)
+		return c;
+
+	spin_lock_irqsave(&to->port->lock, flags);
+	/* Stuff the data into the input queue of the other end */
+	c = tty_insert_flip_string(to->port, buf + done, c - done);
+	spin_unlock_irqrestore(&to->port->lock, flags);
+	/* And shovel */
+	if (c)
+		tty_flip_buffer_push(to->port);
+	return done + c;
+}
 static int receive_buf(struct tty_struct *tty, struct tty_buffer *head, int count)
 {
 	struct tty_ldisc *disc = tty->ldisc;
@@ -357,6 +2007,11 @@ static int receive_buf(struct tty_struct *tty, struct tty_buffer *head, int coun
 	if (~head->flags & TTYB_NORMAL) // tty_buffer 的 TTYB_NORMAL 标志没有被设置，说明缓冲区保存有字符的标志
 		f = flag_buf_ptr(head, head->read);
 
+	if (trace_n_tty_receive_enabled()) { // 告诉 n_tty_receive 事件这批字节的来源, buf->lock 保护
+		tty->port->buf.rx_seq = head->seq;
+		tty->port->buf.rx_off = head->read;
+	}
+
 	if (disc->ops->receive_buf2)
 		count = disc->ops->receive_buf2(tty, p, f, count); // 优先使用 ->receive_buf2() 进行刷新， 在 N_TTY 线路规程中被指定为 n_tty_receive_buf2() 函数
 	else {
@@ -412,8 +2067,15 @@ static int n_tty_receive_buf_common(struct tty_struct *tty, const unsigned char
 {
 	struct n_tty_data *ldata = tty->disc_data;
 	int room, n, rcvd = 0, overflow;
+	size_t head;
+
+	if (test_bit(TTY_PTY_DIRECT, &tty->flags)) { // pty_write_direct() 可能在不能睡眠的上下文中, 拿不到锁就让它走 flip 缓冲区
+		if (!down_read_trylock(&tty->termios_rwsem))
+			return 0;
+	} else
+		down_read(&tty->termios_rwsem);
 
-	down_read(&tty->termios_rwsem);
+	head = ldata->read_head; // 本批数据在 read_buf 中的起始位置, 给 n_tty_receive 事件
 
 	while (1) {
 		/*
@@ -471,7 +2133,502 @@ static int n_tty_receive_buf_common(struct tty_struct *tty, const unsigned char
 	} else
 		n_tty_check_throttle(tty);
 
+	trace_n_tty_receive(tty, head, ldata->read_head, rcvd, read_cnt(ldata));
+
+	/* Moved here from __receive_buf(): one wakeup per batch, keyed so
+	   that epoll and io_uring poll callbacks only fire on EPOLLIN */
+	if (rcvd)
+		n_tty_wake_reader(tty); // 按 TIOCSWAKEUP 设置的策略合并唤醒
+
 	up_read(&tty->termios_rwsem);
 
 	return rcvd;
-}
\ No newline at end of file
+}
+
+static void tty_buffer_reset(struct tty_port *port, struct tty_buffer *p, size_t size)
+{
+	p->used = 0;
+	p->size = size;
+	p->next = NULL;
+	p->commit = 0;
+	p->read = 0;
+	p->flags = 0;
+	p->seq = port->buf.seq + 1; // 只在生产者一侧 (__tty_buffer_request_room) 调用, 不需要原子操作
+	WRITE_ONCE(port->buf.seq, p->seq); // 其他上下文可能同时读取
+}
+
+/*
+ * Flip buffer memory across all ports. A port above its mem_limit may
+ * borrow from tty_flip_budget, up to tty_flip_borrow_max more than its
+ * limit, so a few hot ports are not starved by a static limit. Minimum
+ * size buffers freed by idle ports are handed back by the shrinker
+ * instead of staying on buf->free forever.
+ */
+static unsigned long tty_flip_budget = 16 << 20;
+module_param(tty_flip_budget, ulong, 0644);
+MODULE_PARM_DESC(tty_flip_budget, "Flip buffer bytes ports may borrow above their limit, all ports together");
+
+static int tty_flip_borrow_max = 1 << 20;
+module_param(tty_flip_borrow_max, int, 0644);
+MODULE_PARM_DESC(tty_flip_borrow_max, "Flip buffer bytes one port may borrow above its limit");
+
+static atomic_long_t tty_flip_borrowed;	/* bytes, charged to tty_flip_budget */
+static atomic_long_t tty_flip_cached;	/* buffers on all buf->free lists */
+static atomic_long_t tty_flip_denied;	/* allocations refused, i.e. drops */
+
+/*
+ * Ports with buffers on buf->free. A port joins when tty_buffer_free()
+ * caches its first buffer and leaves when the shrinker empties its list
+ * or tty_buffer_free_all() runs, so ports that never cached anything
+ * (and may be freed without tty_port_destroy()) are never on it.
+ */
+static LIST_HEAD(tty_buffer_ports);
+static DEFINE_SPINLOCK(tty_buffer_ports_lock);
+
+#define TTY_BUFFER_IDLE		(10 * HZ)	/* the shrinker skips ports used more recently */
+
+/*
+ * Take one buffer off buf->free. llist_del_first() must not race with
+ * the shrinker's llist_del_all() (it may read ->next of a buffer the
+ * shrinker just freed); buf->free_lock orders the two. It is only ever
+ * contended by the shrinker, tty_buffer_free() adds without it.
+ */
+static struct tty_buffer *tty_buffer_get_cached(struct tty_bufhead *buf)
+{
+	struct llist_node *first;
+	unsigned long flags;
+
+	spin_lock_irqsave(&buf->free_lock, flags); // 生产者可能在中断上下文
+	first = llist_del_first(&buf->free); // 原来是取下整条链表再把剩下的挂回去, 要遍历到链表尾
+	spin_unlock_irqrestore(&buf->free_lock, flags);
+	if (!first)
+		return NULL;
+	atomic_long_dec(&tty_flip_cached);
+	return llist_entry(first, struct tty_buffer, free);
+}
+
+/* Called from tty_buffer_free() after caching a buffer, consumer side */
+static void tty_buffer_ports_add(struct tty_bufhead *buf)
+{
+	if (!list_empty(&buf->node)) // 已经在链表上, 不拿锁
+		return;
+	spin_lock(&tty_buffer_ports_lock);
+	if (list_empty(&buf->node))
+		list_add_tail(&buf->node, &tty_buffer_ports);
+	spin_unlock(&tty_buffer_ports_lock);
+}
+
+static bool tty_buffer_borrow(struct tty_bufhead *buf, size_t size)
+{
+	if (atomic_read(&buf->mem_used) > buf->mem_limit + READ_ONCE(tty_flip_borrow_max))
+		goto denied;
+	if (atomic_long_add_return(size, &tty_flip_borrowed) > READ_ONCE(tty_flip_budget)) {
+		atomic_long_sub(size, &tty_flip_borrowed);
+		goto denied;
+	}
+	return true;
+denied:
+	atomic_long_inc(&tty_flip_denied); // 驱动随后会丢掉这些字符
+	return false;
+}
+
+/**
+ *	tty_buffer_alloc	-	allocate a tty buffer
+ *	@port: tty port
+ *	@size: desired size (characters)
+ *
+ *	Allocate a new tty buffer to hold the desired number of characters.
+ *	We round our buffers off in 256 character chunks to get better
+ *	allocation behaviour. New buffers come from the port's NUMA node
+ *	(port->node), the node the driver's interrupt and, with
+ *	TTY_FLUSH_IRQ, flush_to_ldisc() run on.
+ *	Return NULL if out of memory or the allocation would exceed the
+ *	per device queue
+ */
+static struct tty_buffer *tty_buffer_alloc(struct tty_port *port, size_t size)
+{
+	struct tty_bufhead *buf = &port->buf;
+	struct tty_buffer *p;
+	int borrowed = 0;
+
+	/* Round the buffer size out */
+	size = __ALIGN_MASK(size, TTYB_ALIGN_MASK);
+
+	if (READ_ONCE(buf->last_alloc) != jiffies)
+		WRITE_ONCE(buf->last_alloc, jiffies); // 供 shrinker 判断端口是否空闲, shrinker 不拿端口的锁读取
+
+	if (size <= MIN_TTYB_SIZE) {
+		p = tty_buffer_get_cached(buf);
+		if (p)
+			goto found;
+	}
+
+	/* Over the per port limit: borrow from the global budget */
+	if (atomic_read(&buf->mem_used) > buf->mem_limit) {
+		if (!tty_buffer_borrow(buf, size))
+			return NULL;
+		borrowed = 1;
+	}
+	p = kmalloc_node(sizeof(struct tty_buffer) + 2 * size, GFP_ATOMIC, port->node); // NUMA_NO_NODE 时和 kmalloc 一样
+	if (p == NULL) {
+		if (borrowed)
+			atomic_long_sub(size, &tty_flip_borrowed);
+		return NULL;
+	}
+	p->borrowed = borrowed; // tty_buffer_reset() 不清除, 跟着这块内存走
+
+found:
+	tty_buffer_reset(port, p, size);
+	atomic_add(size, &buf->mem_used);
+	return p;
+}
+
+/**
+ *	tty_buffer_free		-	free a tty buffer
+ *	@port: tty port owning the buffer
+ *	@b: the buffer to free
+ *
+ *	Free a tty buffer, or add it to the free list according to our
+ *	internal strategy. Borrowed buffers are never cached, they go back
+ *	to the global budget right away.
+ */
+static void tty_buffer_free(struct tty_port *port, struct tty_buffer *b)
+{
+	struct tty_bufhead *buf = &port->buf;
+
+	/* Dumb strategy for now - should keep some stats */
+	WARN_ON(atomic_sub_return(b->size, &buf->mem_used) < 0);
+
+	if (b->borrowed) {
+		atomic_long_sub(b->size, &tty_flip_borrowed);
+		kfree(b);
+	} else if (b->size > MIN_TTYB_SIZE)
+		kfree(b);
+	else if (b->size > 0) {
+		llist_add(&b->free, &buf->free);
+		atomic_long_inc(&tty_flip_cached);
+		tty_buffer_ports_add(buf);
+	}
+}
+
+static unsigned long tty_buffer_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+	return atomic_long_read(&tty_flip_cached);
+}
+
+static unsigned long tty_buffer_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct tty_bufhead *buf, *tmp;
+	struct tty_buffer *p, *next;
+	struct llist_node *llist;
+	unsigned long freed = 0;
+	unsigned long flags;
+
+	spin_lock(&tty_buffer_ports_lock);
+	list_for_each_entry_safe(buf, tmp, &tty_buffer_ports, node) {
+		if (time_before(jiffies, READ_ONCE(buf->last_alloc) + TTY_BUFFER_IDLE))
+			continue; // 活跃的端口保留缓存
+		list_del_init(&buf->node); // 下一次 tty_buffer_free() 缓存时重新加入
+		spin_lock_irqsave(&buf->free_lock, flags);
+		llist = llist_del_all(&buf->free);
+		spin_unlock_irqrestore(&buf->free_lock, flags);
+		llist_for_each_entry_safe(p, next, llist, free) {
+			kfree(p);
+			freed++;
+		}
+		if (freed >= sc->nr_to_scan)
+			break;
+	}
+	spin_unlock(&tty_buffer_ports_lock);
+
+	atomic_long_sub(freed, &tty_flip_cached);
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker tty_buffer_shrinker = {
+	.count_objects	= tty_buffer_shrink_count,
+	.scan_objects	= tty_buffer_shrink_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+
+/* /sys/kernel/debug/tty_flip: flip buffer footprint and drops */
+static int tty_flip_stats_show(struct seq_file *m, void *v)
+{
+	long cached = atomic_long_read(&tty_flip_cached);
+
+	seq_printf(m, "borrowed_bytes %ld\n", atomic_long_read(&tty_flip_borrowed));
+	seq_printf(m, "budget_bytes %lu\n", READ_ONCE(tty_flip_budget));
+	seq_printf(m, "cached_buffers %ld\n", cached);
+	seq_printf(m, "cached_bytes %zu\n", cached * (sizeof(struct tty_buffer) + 2 * MIN_TTYB_SIZE));
+	seq_printf(m, "denied %ld\n", atomic_long_read(&tty_flip_denied));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tty_flip_stats);
+
+/* Called from tty_init() */
+int __init tty_buffer_shrinker_init(void)
+{
+	debugfs_create_file("tty_flip", 0444, NULL, NULL, &tty_flip_stats_fops);
+	return register_shrinker(&tty_buffer_shrinker);
+}
+
+/**
+ *	tty_buffer_free_all		-	free buffers used by a tty
+ *	@port: tty port to free from
+ *
+ *	Remove all the buffers pending on a tty whether queued with data
+ *	or in the free ring. Must be called when the tty is no longer in use
+ */
+void tty_buffer_free_all(struct tty_port *port)
+{
+	struct tty_bufhead *buf = &port->buf;
+	struct tty_buffer *p, *next;
+	struct llist_node *llist;
+	unsigned int freed = 0;
+	long cached = 0;
+	int still_used;
+
+	spin_lock(&tty_buffer_ports_lock);
+	list_del_init(&buf->node); // 之后 shrinker 不会再访问这个端口
+	spin_unlock(&tty_buffer_ports_lock);
+
+	while ((p = buf->head) != NULL) {
+		buf->head = p->next;
+		freed += p->size;
+		if (p->borrowed)
+			atomic_long_sub(p->size, &tty_flip_borrowed);
+		if (p->size > 0)
+			kfree(p);
+	}
+	llist = llist_del_all(&buf->free);
+	llist_for_each_entry_safe(p, next, llist, free) {
+		kfree(p);
+		cached++;
+	}
+	atomic_long_sub(cached, &tty_flip_cached);
+
+	tty_buffer_reset(port, &buf->sentinel, 0);
+	buf->head = &buf->sentinel;
+	buf->tail = &buf->sentinel;
+
+	still_used = atomic_xchg(&buf->mem_used, 0);
+	WARN(still_used != freed, "we still have not freed %d bytes!",
+			still_used - freed);
+}
+
+/**
+ *	tty_buffer_init		-	prepare a tty buffer structure
+ *	@port: tty port to initialise
+ *
+ *	Set up the initial state of the buffer management for a tty device.
+ *	Must be called before the other tty buffer functions are used.
+ */
+void tty_buffer_init(struct tty_port *port)
+{
+	struct tty_bufhead *buf = &port->buf;
+
+	mutex_init(&buf->lock);
+	tty_buffer_reset(port, &buf->sentinel, 0);
+	buf->head = &buf->sentinel;
+	buf->tail = &buf->sentinel;
+	buf->push_seq = buf->sentinel.seq;
+	init_llist_head(&buf->free);
+	spin_lock_init(&buf->free_lock);
+	INIT_LIST_HEAD(&buf->node); // 有缓存的 tty_buffer 时才加入 tty_buffer_ports
+	atomic_set(&buf->mem_used, 0);
+	atomic_set(&buf->priority, 0);
+	INIT_WORK(&buf->work, flush_to_ldisc);
+	buf->mem_limit = TTYB_DEFAULT_MEM_LIMIT;
+	buf->flush_mode = TTY_FLUSH_UNBOUND;
+	buf->flush_cpu = WORK_CPU_UNBOUND; // 0 是有效的 cpu, TTY_FLUSH_READER 在第一次 read() 之前不能落到 cpu 0 上
+	WRITE_ONCE(buf->last_alloc, jiffies);
+}
+
+/**
+ * tty_port_init -- initialize tty_port
+ * @port: tty_port to initialize
+ *
+ * Initializes the state of struct tty_port. When a port was initialized using
+ * this function, one has to destroy the port by tty_port_destroy(). Either
+ * indirectly by using tty_port refcounting (tty_port_put()) or directly if
+ * refcounting is not used.
+ */
+void tty_port_init(struct tty_port *port)
+{
+	memset(port, 0, sizeof(*port));
+	port->node = NUMA_NO_NODE; // 0 是一个有效的 node; 驱动知道中断所在的 node 时再设置
+	tty_buffer_init(port);
+	init_waitqueue_head(&port->open_wait);
+	init_waitqueue_head(&port->close_wait);
+	init_waitqueue_head(&port->delta_msr_wait);
+	mutex_init(&port->mutex);
+	mutex_init(&port->buf_mutex);
+	spin_lock_init(&port->lock);
+	port->close_delay = (50 * HZ) / 100;
+	port->closing_wait = (3000 * HZ) / 100;
+	kref_init(&port->kref);
+}
+
+/**
+ *	tty_buffer_set_flush_affinity	-	choose where flush_to_ldisc runs
+ *	@port: tty port
+ *	@mode: TTY_FLUSH_*
+ *	@cpu: target cpu for TTY_FLUSH_CPU, ignored otherwise
+ *
+ *	TTY_FLUSH_IRQ keeps flush_to_ldisc() on the cpu of the interrupt that
+ *	last pushed data, so the flip buffer and the ldisc's read_buf stay in
+ *	that cpu's cache. TTY_FLUSH_READER runs it where the reader last
+ *	called read(), so the copy_to_user() finds read_buf local instead.
+ */
+int tty_buffer_set_flush_affinity(struct tty_port *port, int mode, int cpu)
+{
+	struct tty_bufhead *buf = &port->buf;
+
+	switch (mode) {
+	case TTY_FLUSH_CPU:
+		if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu))
+			return -EINVAL;
+		break;
+	case TTY_FLUSH_UNBOUND:
+	case TTY_FLUSH_IRQ:
+	case TTY_FLUSH_READER:
+		cpu = WORK_CPU_UNBOUND;
+		break;
+	default:
+		return -EINVAL;
+	}
+	WRITE_ONCE(buf->flush_cpu, cpu);
+	WRITE_ONCE(buf->flush_mode, mode);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(tty_buffer_set_flush_affinity);
+
+/* Called from tty_read_iter(): remember the reader's cpu for TTY_FLUSH_READER */
+static inline void tty_buffer_note_reader(struct tty_port *port)
+{
+	struct tty_bufhead *buf = &port->buf;
+	int cpu = raw_smp_processor_id();
+
+	if (READ_ONCE(buf->flush_mode) == TTY_FLUSH_READER && READ_ONCE(buf->flush_cpu) != cpu)
+		WRITE_ONCE(buf->flush_cpu, cpu); // 只在读者迁移 cpu 时写, 避免每次 read 都弄脏这个 cacheline
+}
+
+/*
+ * Every (re)start of flush_to_ldisc() goes through here, so that
+ * flush_mode holds for all of them: tty_flip_buffer_push(), and
+ * tty_buffer_restart_work() after an ldisc change or when n_tty makes
+ * room again. flush_cpu is the fixed cpu, the reader's cpu, or for
+ * TTY_FLUSH_IRQ the cpu of the last push, so a restart from a reader
+ * still runs next to the interrupt.
+ */
+static bool tty_buffer_queue_work(struct tty_bufhead *buf)
+{
+	int cpu;
+
+	switch (READ_ONCE(buf->flush_mode)) {
+	case TTY_FLUSH_IRQ:
+	case TTY_FLUSH_READER:
+	case TTY_FLUSH_CPU:
+		cpu = READ_ONCE(buf->flush_cpu);
+		if (cpu != WORK_CPU_UNBOUND && cpu_online(cpu))
+			break;
+		fallthrough;
+	default:
+		return queue_work(system_unbound_wq, &buf->work);
+	}
+	return queue_work_on(cpu, system_wq, &buf->work);
+}
+
+/**
+ *	tty_buffer_restart_work	-	restart flush_to_ldisc()
+ *	@port: tty port
+ *
+ *	Used when the ldisc can take data again without new input arriving:
+ *	after tty_set_ldisc() and from n_tty_kick_worker(). Honours the
+ *	port's flush affinity like tty_flip_buffer_push().
+ */
+bool tty_buffer_restart_work(struct tty_port *port)
+{
+	return tty_buffer_queue_work(&port->buf); // 原来直接 queue_work(system_unbound_wq, ...)
+}
+
+/*
+ * One tty_flip_push event per buffer published since the last push: the
+ * rest of each buffer the producer sealed in between (seqs are
+ * consecutive, so no pointer to them is needed), then the new part of
+ * the tail. push_seq/push_off are producer side, like bufhead->seq.
+ */
+static void tty_flip_trace_push(struct tty_port *port, struct tty_buffer *tail)
+{
+	struct tty_bufhead *buf = &port->buf;
+	u32 seq = buf->push_seq;
+	int off = buf->push_off;
+
+	if (trace_tty_flip_push_enabled()) {
+		for (; seq != tail->seq; seq++, off = 0) // 上次 push 之后封口的缓冲区, 可能已经被释放, count 记为 -1
+			trace_tty_flip_push(port, seq, off, -1);
+		trace_tty_flip_push(port, tail->seq, off, tail->used - off);
+	}
+	buf->push_seq = tail->seq;
+	buf->push_off = tail->used;
+}
+
+/**
+ *	tty_flip_buffer_push	-	terminal
+ *	@port: tty port to push
+ *
+ *	Queue a push of the terminal flip buffers to the line discipline.
+ *	Can be called from IRQ/atomic context.
+ */
+void tty_flip_buffer_push(struct tty_port *port)
+{
+	struct tty_bufhead *buf = &port->buf;
+	struct tty_buffer *tail = buf->tail;
+	int cpu = raw_smp_processor_id();
+
+	if (READ_ONCE(buf->flush_mode) == TTY_FLUSH_IRQ && READ_ONCE(buf->flush_cpu) != cpu)
+		WRITE_ONCE(buf->flush_cpu, cpu); // 驱动在中断里调用, 当前 cpu 就是中断所在 cpu; 中断迁移时才写
+
+	tty_flip_trace_push(port, tail); // 两次 push 之间发布的每个缓冲区一个事件
+
+	/* paired w/ acquire in flush_to_ldisc(); ensures
+	 * flush_to_ldisc() sees buffer data.
+	 */
+	smp_store_release(&tail->commit, tail->used);
+	tty_buffer_queue_work(buf); // 按 buf->flush_mode 选择 cpu
+}
+
+/*
+ * 接收数据路径
+ * 数据从 uart 驱动进入 tty 核心, 一直到用户 read() 返回的调用链. 标注 [内核服务] 的地方是这条路径依赖的外部设施, 单独把这几个函数
+ * 拿出来在用户空间跑时, 只需要替换这些点, 其余逻辑 (tty_buffer 链表的生产/消费, n_tty 的 read_buf 环形缓冲区) 可以原样使用.
+ * uart 中断处理函数 (low level driver)
+ *     uart_insert_char                            // 每个字符带一个 flag 写入 tty_buffer
+ *         tty_insert_flip_char
+ *             __tty_buffer_request_room           // tail 缓冲区不够时申请新的 tty_buffer       [内核服务] kmalloc / llist
+ *     tty_flip_buffer_push
+ *         tty_schedule_flip                       // 发布 tail->commit, 唤醒消费者           [内核服务] smp_store_release / queue_work
+ *             tty_buffer_queue_work               // 按 flush_mode 选择 cpu                 [内核服务] queue_work_on
+ *
+ * flush_to_ldisc                                  // 工作队列上下文, buf->lock 保证单消费者   [内核服务] mutex / ld_semaphore
+ *     tty_ldisc_ref
+ *     receive_buf                                 // head->commit - head->read 为本次可刷新字节数
+ *         n_tty_receive_buf2
+ *             n_tty_receive_buf_common            // 按 read_buf 剩余空间分批调用 __receive_buf  [内核服务] termios_rwsem
+ *                 __receive_buf
+ *                     n_tty_receive_buf_real_raw / _raw / _standard ...
+ *                 n_tty_check_throttle            // read_buf 快满时通知驱动停止发送
+ *             wake_up_interruptible_poll(&tty->read_wait, ...)                            [内核服务] wait_queue
+ *     tty_buffer_free                             // 刷新完的 tty_buffer 回到 buf->free 链表
+ *
+ * n_tty_read                                      // 用户进程上下文
+ *     copy_from_read_buf / canon_copy_from_read_buf   // read_tail 的 smp_store_release 与上面 n_tty_receive_buf_common 中的
+ *                                                     // smp_load_acquire(&ldata->read_tail) 配对
+ *     n_tty_kick_worker                           // 之前因 no_room 停下的 flush_to_ldisc 在这里被重新调度
+ *
+ * 发送数据路径
+ * uart_write                                      // tty_operations->write
+ *     memcpy 到 uart_state->xmit (circ_buf, 一页)  // 写满后 tty_write 在 tty->write_wait 上睡眠
+ *     __uart_start -> uart_ops->start_tx          // 驱动在 TX 中断里从 xmit 取数据, serial_out() 逐字节写寄存器
+ *     uart_write_wakeup                           // uart_circ_chars_pending(xmit) < WAKEUP_CHARS 时由驱动调用
+ */
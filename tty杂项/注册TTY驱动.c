@@ -1,15 +1,28 @@
+/*
+ * dev_t -> tty_driver map, one multi-index entry per driver covering its
+ * whole minor range. Written under tty_mutex, read under RCU, so an open
+ * no longer walks the tty_drivers list under tty_mutex. Drivers are freed
+ * with kfree_rcu() in destruct_tty_driver() for this.
+ *
+ * Multi-index entries need CONFIG_XARRAY_MULTI: "config TTY" in
+ * drivers/tty/Kconfig selects XARRAY_MULTI. Without it xa_store_range()
+ * would store one entry per minor.
+ */
+#ifndef CONFIG_XARRAY_MULTI
+#error "TTY must select XARRAY_MULTI"
+#endif
+static DEFINE_XARRAY(tty_drivers_xa);
+
 int tty_register_driver(struct tty_driver *driver)
 { 注册一个 tty_driver.
   (1) tty_driver 是驱动 tty 设备的, 因此需要给 tty 设备申请 tty_driver->num 数量的设备号, 设备号可以自己定义, 也可以随机分配.
   (2) 如果 tty_driver 的 TTY_DRIVER_DYNAMIC_ALLOC 标志事先被设置, 那么将创建 tty_driver->num 数量的 tty 字符设备, 操作函数集是 tty_fops(/* 这些字符设备的名字？ */).
   (3) 该 tty_driver 通过 tty_driver->tty_drivers 挂在 tty_drivers 全局链表下(/* 访问该链表，需要使用 tty_mutex 锁 */).
-  (4) 如果 tty_driver 的 TTY_DRIVER_DYNAMIC_DEV 标志事先不被设置, 
+  (4) 如果 tty_driver 的 TTY_DRIVER_DYNAMIC_DEV 标志事先不被设置, 通过 tty_register_device_range() 一次性注册全部 tty 设备.
   (5)
   (6) 设置 tty_driver 的 TTY_DRIVER_INSTALLED 标志, 表明该 tty 驱动已经被注册成功.
 	int error;
-	int i;
 	dev_t dev;
-	struct device *d;
 
     // 申请设备号, 设备号可以事先提供, 也可以由内核自动分配
 	if (!driver->major) {
@@ -32,27 +45,26 @@ int tty_register_driver(struct tty_driver *driver)
 	}
 
 	mutex_lock(&tty_mutex);
-	list_add(&driver->tty_drivers, &tty_drivers); // 将 tty 驱动加到 tty_drivers 链表中
+	error = xa_err(xa_store_range(&tty_drivers_xa, dev, dev + driver->num - 1, driver, GFP_KERNEL)); // 按设备号索引, 供 get_tty_driver() 查找
+	if (error) {
+		mutex_unlock(&tty_mutex);
+		goto err_unreg_char;
+	}
+	list_add(&driver->tty_drivers, &tty_drivers); // 将 tty 驱动加到 tty_drivers 链表中, /proc/tty/drivers 遍历使用
 	mutex_unlock(&tty_mutex);
 
 	if (!(driver->flags & TTY_DRIVER_DYNAMIC_DEV)) { // 由 uart_register_driver 注册的串口 tty 驱动会同步设置该标志
-		for (i = 0; i < driver->num; i++) { // 注册 driver->num 数量的 individual tty devices
-			d = tty_register_device(driver, i, NULL);
-			if (IS_ERR(d)) {
-				error = PTR_ERR(d);
-				goto err_unreg_devs;
-			}
-		}
+		error = tty_register_device_range(driver, 0, driver->num, NULL); // 注册 driver->num 数量的 individual tty devices,
+		if (error)                                                       // 失败时已经自行回滚
+			goto err_unreg_list;
 	}
 	proc_tty_register_driver(driver);
 	driver->flags |= TTY_DRIVER_INSTALLED; // 表明该 tty 驱动已经被注册成功
 	return 0;
 
-err_unreg_devs:
-	for (i--; i >= 0; i--)
-		tty_unregister_device(driver, i);
-
+err_unreg_list:
 	mutex_lock(&tty_mutex);
+	xa_store_range(&tty_drivers_xa, dev, dev + driver->num - 1, NULL, GFP_KERNEL);
 	list_del(&driver->tty_drivers);
 	mutex_unlock(&tty_mutex);
 
@@ -61,6 +73,84 @@ err_unreg_char:
 err:
 	return error;
 }
+
+/**
+ *	get_tty_driver		-	find device of a tty
+ *	@device: device identifier
+ *	@index: returns the index of the tty
+ *
+ *	This routine returns a tty driver structure, given a device number
+ *	and also passes back the index number.
+ *
+ *	Locking: none, takes rcu_read_lock
+ */
+static struct tty_driver *get_tty_driver(dev_t device, int *index)
+{
+	struct tty_driver *p;
+
+	rcu_read_lock();
+	p = xa_load(&tty_drivers_xa, device); // 原来是 list_for_each_entry(p, &tty_drivers, tty_drivers) 逐个比较设备号范围
+	if (p && !kref_get_unless_zero(&p->kref)) // 驱动正在被注销
+		p = NULL;
+	rcu_read_unlock();
+
+	if (p)
+		*index = device - MKDEV(p->major, p->minor_start);
+	return p;
+}
+
+/*
+ * The xarray range is erased before the chrdev region is released: once
+ * the region is free another driver may register the same numbers and
+ * store its own entry, which must not be wiped here. The entry is only
+ * erased while it still points at @driver; tty_mutex serializes this
+ * against tty_register_driver().
+ */
+void tty_unregister_driver(struct tty_driver *driver)
+{
+	dev_t dev = MKDEV(driver->major, driver->minor_start);
+
+	mutex_lock(&tty_mutex);
+	if (xa_load(&tty_drivers_xa, dev) == driver) // 整个次设备号范围是一个 multi-index 条目
+		xa_store_range(&tty_drivers_xa, dev, dev + driver->num - 1, NULL, GFP_KERNEL);
+	list_del(&driver->tty_drivers);
+	mutex_unlock(&tty_mutex);
+	unregister_chrdev_region(dev, driver->num); // 之后设备号才可以被别的驱动重新申请
+}
+
+static void destruct_tty_driver(struct kref *kref)
+{
+	struct tty_driver *driver = container_of(kref, struct tty_driver, kref);
+	int i;
+	struct ktermios *tp;
+
+	if (driver->flags & TTY_DRIVER_INSTALLED) {
+		for (i = 0; i < driver->num; i++) {
+			tp = driver->termios[i];
+			if (tp) {
+				driver->termios[i] = NULL;
+				kfree(tp);
+			}
+			if (!(driver->flags & TTY_DRIVER_DYNAMIC_DEV))
+				tty_unregister_device(driver, i);
+		}
+		proc_tty_unregister_driver(driver);
+		if (driver->flags & TTY_DRIVER_DYNAMIC_ALLOC)
+			cdev_del(&driver->cdevs[0]);
+	}
+	kfree(driver->cdevs);
+	kfree(driver->ports);
+	kfree(driver->termios);
+	kfree(driver->ttys);
+	tty_xmit_pool_destroy(driver->xmit_pool); // 端口都已经释放了 xmit_buf, 池子里的页面一起释放
+	kfree_rcu(driver, rcu); // get_tty_driver() 可能还在 rcu_read_lock() 中对它做 kref_get_unless_zero()
+}
+
+void tty_driver_kref_put(struct tty_driver *driver)
+{
+	kref_put(&driver->kref, destruct_tty_driver);
+}
+
 static int tty_cdev_add(struct tty_driver *driver, dev_t dev, unsigned int index, unsigned int count)
 { 创建 count 数量的 tty字符设备.
 	/* init here, since reused cdevs cause crashes */
@@ -72,6 +162,154 @@ struct device *tty_register_device(struct tty_driver *driver, unsigned index, st
 {
 	return tty_register_device_attr(driver, index, device, NULL, NULL);
 }
+
+/*
+ * Devices registered by tty_register_device_range() share one allocation;
+ * each member drops a reference on release and the last one frees it.
+ */
+struct tty_dev_block {
+	atomic_t		refs;
+	struct tty_block_dev {
+		struct device		dev;
+		struct tty_dev_block	*blk;
+		int			error;	/* device_add() result */
+	} slot[];
+};
+
+static ASYNC_DOMAIN_EXCLUSIVE(tty_register_domain);
+
+static void tty_dev_block_release(struct device *dev)
+{
+	struct tty_block_dev *bd = container_of(dev, struct tty_block_dev, dev);
+
+	if (atomic_dec_and_test(&bd->blk->refs))
+		kfree(bd->blk);
+}
+
+static void tty_add_block_dev(void *data, async_cookie_t cookie)
+{
+	struct tty_block_dev *bd = data;
+
+	bd->error = device_add(&bd->dev); // 不同端口的 device_add 互不依赖, 可以并行
+}
+
+/**
+ *	tty_register_device_range - register a run of tty devices at once
+ *	@driver: the tty driver that describes the tty devices
+ *	@first: index of the first device
+ *	@count: number of devices
+ *	@device: parent device, may be NULL
+ *
+ *	Bulk form of tty_register_device() for drivers with many lines, such
+ *	as multi-port serial cards. All @count struct devices come from a
+ *	single allocation and the sysfs/devtmpfs work of device_add() runs
+ *	in parallel on the async domain. Drivers that also want a single
+ *	cdev for the whole range should set TTY_DRIVER_DYNAMIC_ALLOC, in
+ *	which case tty_register_driver() already added it.
+ *
+ *	Either all devices are registered or none are.
+ *
+ *	Locking: none, may sleep
+ */
+int tty_register_device_range(struct tty_driver *driver, unsigned first, unsigned count, struct device *device)
+{
+	return tty_register_device_range_attr(driver, first, count, device, NULL, NULL, NULL);
+}
+
+/**
+ *	tty_register_device_range_attr - register a run of tty devices at once
+ *	@driver: the tty driver that describes the tty devices
+ *	@first: index of the first device
+ *	@count: number of devices
+ *	@device: parent device, may be NULL
+ *	@drvdata: per device driver data, @count entries, may be NULL
+ *	@attr_grps: per device attribute groups, @count entries, may be NULL
+ *	@devs: if not NULL, receives the @count registered devices
+ *
+ *	tty_register_device_range() with what tty_register_device_attr()
+ *	takes per device; used by uart_add_ports() for multi-port cards.
+ */
+int tty_register_device_range_attr(struct tty_driver *driver, unsigned first, unsigned count, struct device *device,
+				   void **drvdata, const struct attribute_group ***attr_grps, struct device **devs)
+{
+	dev_t base = MKDEV(driver->major, driver->minor_start) + first;
+	struct tty_dev_block *blk;
+	char name[64];
+	unsigned i, added = 0;
+	int retval = 0;
+
+	if (!count || first + count > driver->num)
+		return -EINVAL;
+
+	if (driver->flags & TTY_DRIVER_DEVPTS_MEM) // 同 tty_register_device_attr(), unix98 pty 不创建 sysfs 设备
+		return -EINVAL;
+
+	blk = kzalloc(struct_size(blk, slot, count), GFP_KERNEL); // 整个区间只申请一次内存, 而不是每个设备一次 kzalloc
+	if (!blk)
+		return -ENOMEM;
+	atomic_set(&blk->refs, count);
+
+	for (i = 0; i < count; i++) {
+		struct device *dev = &blk->slot[i].dev;
+
+		if (driver->type == TTY_DRIVER_TYPE_PTY)
+			pty_line_name(driver, first + i, name);
+		else
+			tty_line_name(driver, first + i, name);
+
+		blk->slot[i].blk = blk;
+		device_initialize(dev);
+		dev->devt = base + i;
+		dev->class = tty_class;
+		dev->parent = device;
+		dev->release = tty_dev_block_release;
+		dev_set_name(dev, "%s", name);
+		if (attr_grps)
+			dev->groups = attr_grps[i];
+		if (drvdata)
+			dev_set_drvdata(dev, drvdata[i]);
+	}
+
+	if (!(driver->flags & TTY_DRIVER_DYNAMIC_ALLOC)) {
+		for (i = 0; i < count; i++) {
+			retval = tty_cdev_add(driver, base + i, first + i, 1);
+			if (retval)
+				goto err_del_cdevs;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		async_schedule_domain(tty_add_block_dev, &blk->slot[i], &tty_register_domain);
+	async_synchronize_full_domain(&tty_register_domain); // 等待所有 device_add 完成
+
+	for (i = 0; i < count; i++) {
+		if (blk->slot[i].error)
+			retval = blk->slot[i].error;
+		else
+			added++;
+	}
+	if (!retval) {
+		for (i = 0; devs && i < count; i++)
+			devs[i] = &blk->slot[i].dev;
+		return 0;
+	}
+
+	for (i = 0; i < count && added; i++) { // 有一个失败就全部回滚
+		if (!blk->slot[i].error) {
+			device_del(&blk->slot[i].dev);
+			added--;
+		}
+	}
+	i = count;
+
+err_del_cdevs:
+	if (!(driver->flags & TTY_DRIVER_DYNAMIC_ALLOC))
+		while (i--)
+			cdev_del(&driver->cdevs[first + i]);
+	for (i = 0; i < count; i++)
+		put_device(&blk->slot[i].dev); // 最后一个 put_device 释放 blk
+	return retval;
+}
 /**
  *	tty_register_device_attr - register a tty device
  *	@driver: the tty driver that describes the tty device
@@ -90,6 +328,10 @@ struct device *tty_register_device(struct tty_driver *driver, unsigned index, st
  *	that bit is not set, this function should not be called by a tty
  *	driver.
  *
+ *	Unix98 pty drivers (TTY_DRIVER_DEVPTS_MEM) get their nodes from devpts
+ *	when a pair is actually opened (devpts also allocates the index), so
+ *	they must not register devices here; -EINVAL is returned.
+ *
  *	Locking: ??
  */
 struct device *tty_register_device_attr(struct tty_driver *driver, unsigned index, struct device *device,
@@ -106,6 +348,9 @@ struct device *tty_register_device_attr(struct tty_driver *driver, unsigned inde
 		return ERR_PTR(-EINVAL);
 	}
 
+	if (WARN_ON_ONCE(driver->flags & TTY_DRIVER_DEVPTS_MEM)) // unix98 pty 不在这里创建 sysfs 设备, /dev/pts/N 节点由 devpts 在 ptmx_open() 时按需创建
+		return ERR_PTR(-EINVAL);
+
 	if (driver->type == TTY_DRIVER_TYPE_PTY) // 创建这个设备的名字，这个名字合成很有讲究，如果要研究 /dev 下的 tty 设备名字, 可以看这里
 		pty_line_name(driver, index, name); // 该驱动是 TTY_DRIVER_TYPE_PTY 类型的
 	else
@@ -159,6 +404,9 @@ static char ptychar[] = "pqrstuvwxyzabcde";
 static void pty_line_name(struct tty_driver *driver, int index, char *p)
 {
 	int i = index + driver->name_base;
+
+	/* ptychar[] x hex digit only spells 256 legacy names */
+	WARN_ON_ONCE(i >= 256); // legacy pty 最多 256 个, 更多的 pty 应该使用 unix98 (devpts) 方式
 	/* ->name is initialized to "ttyp", but "tty" is expected */
 	sprintf(p, "%s%c%x", driver->subtype == PTY_TYPE_SLAVE ? "tty" : driver->name, ptychar[i >> 4 & 0xf], i & 0xf);
 }
@@ -179,4 +427,4 @@ static ssize_t tty_line_name(struct tty_driver *driver, int index, char *p)
 		return sprintf(p, "%s", driver->name);
 	else
 		return sprintf(p, "%s%d", driver->name, index + driver->name_base);
-}
\ No newline at end of file
+}
@@ -26,6 +26,13 @@ struct n_tty_data {
 
 	int minimum_to_wake;
 
+	/* reader wakeup policy, see n_tty_wake_reader() */
+	unsigned int wake_bytes;
+	unsigned int wake_delay_us;
+	struct hrtimer wake_timer;
+	struct tty_struct *tty;
+	struct work_struct unthrottle_work;	/* unthrottle on behalf of IOCB_NOWAIT reads */
+
 	/* consumer-published */
 	size_t read_tail;
 	size_t line_start;
@@ -39,6 +46,96 @@ struct n_tty_data {
 	struct mutex output_lock;
 };
 
+/* TIOCSWAKEUP / TIOCGWAKEUP */
+struct tty_wakeup_policy {
+	unsigned int bytes;	/* wake once this many bytes are readable, 0 = every batch */
+	unsigned int delay_us;	/* ... or this long after data first arrived, at most 1s */
+};
+
+/*
+ * Readers (tty_ldisc_ref*() on every read, write, ioctl and flush_to_ldisc())
+ * only touch this cpu's read_count and read block. Writers (ldisc change,
+ * hangup) set block and wait for the per-cpu counts to drain.
+ */
+struct ld_semaphore {
+	unsigned int __percpu	*read_count;
+	atomic_t		block;		/* writer holds or is acquiring */
+	wait_queue_head_t	readers_wait;	/* blocked readers and writers, woken by up_write */
+	wait_queue_head_t	writer_wait;	/* writer draining, woken by readers */
+#ifdef CONFIG_DEBUG_LOCK_ALLOC
+	struct lockdep_map	dep_map;
+#endif
+};
+
+int __init_ldsem(struct ld_semaphore *sem, const char *name, struct lock_class_key *key);
+
+#define init_ldsem(sem)						\
+({								\
+	static struct lock_class_key __key;			\
+								\
+	__init_ldsem((sem), #sem, &__key);			\
+})
+
+#ifdef CONFIG_DEBUG_LOCK_ALLOC
+int ldsem_down_read_nested(struct ld_semaphore *sem, int subclass, long timeout);
+int ldsem_down_write_nested(struct ld_semaphore *sem, int subclass, long timeout);
+#else
+# define ldsem_down_read_nested(sem, subclass, timeout)		\
+		ldsem_down_read(sem, timeout)
+# define ldsem_down_write_nested(sem, subclass, timeout)	\
+		ldsem_down_write(sem, timeout)
+#endif
+
+struct tty_ldisc_ops {
+	int	magic;
+	char	*name;
+	int	num;
+	int	flags;
+
+	/*
+	 * The following routines are called from above.
+	 */
+	int	(*open)(struct tty_struct *);
+	void	(*close)(struct tty_struct *);
+	void	(*flush_buffer)(struct tty_struct *tty);
+	ssize_t	(*read)(struct tty_struct *tty, struct file *file,
+			struct kiocb *iocb, struct iov_iter *to); // 原来是 (tty, file, unsigned char __user *buf, size_t nr), 拿到 iocb 才能判断 IOCB_NOWAIT
+	ssize_t	(*write)(struct tty_struct *tty, struct file *file,
+			 struct kiocb *iocb, const unsigned char *buf, size_t nr); // 和 read 一样加了 iocb, 判断 IOCB_NOWAIT
+	int	(*ioctl)(struct tty_struct *tty, struct file *file,
+			 unsigned int cmd, unsigned long arg);
+	int	(*compat_ioctl)(struct tty_struct *tty, struct file *file,
+				unsigned int cmd, unsigned long arg);
+	void	(*set_termios)(struct tty_struct *tty, struct ktermios *old);
+	__poll_t (*poll)(struct tty_struct *, struct file *,
+			     struct poll_table_struct *);
+	int	(*hangup)(struct tty_struct *tty);
+
+	/*
+	 * The following routines are called from below.
+	 */
+	void	(*receive_buf)(struct tty_struct *, const unsigned char *cp,
+			       char *fp, int count);
+	void	(*write_wakeup)(struct tty_struct *);
+	void	(*dcd_change)(struct tty_struct *, unsigned int);
+	void	(*fasync)(struct tty_struct *tty, int on);
+	int	(*receive_buf2)(struct tty_struct *, const unsigned char *cp,
+				char *fp, int count);
+	int	(*take_unread)(struct tty_struct *tty, unsigned char *buf,
+			       int count); // 可选, 见 tty_ldisc_requeue_unread()
+
+	struct  module *owner;
+
+	int __percpu *refcount; // 原来是 int refcount, 见 get_ldops()/put_ldops()
+};
+
+#define LDISC_FLAG_NOWAIT	0x00000002	/* read/write return -EAGAIN instead of sleeping under IOCB_NOWAIT */
+
+struct tty_ldisc {
+	struct tty_ldisc_ops *ops;	/* NULL while an embedded slot is free */
+	struct tty_struct *tty;
+};
+
 struct tty_struct {
 	int	magic;
 	struct kref kref;
@@ -50,6 +147,8 @@ struct tty_struct {
 	/* Protects ldisc changes: Lock tty not pty */
 	struct ld_semaphore ldisc_sem;
 	struct tty_ldisc *ldisc;
+	struct tty_ldisc ldisc_slot[2];	/* current + one being switched to */
+	unsigned long ldisc_slot_used;	/* bit per ldisc_slot[], see tty_ldisc_slot() */
 
 	struct mutex atomic_write_lock;
 	struct mutex legacy_mutex;
@@ -82,9 +181,10 @@ struct tty_struct {
 	int alt_speed;		/* For magic substitution of 38400 bps */
 	wait_queue_head_t write_wait;
 	wait_queue_head_t read_wait;
-	struct work_struct hangup_work;
+	struct llist_node hangup_node;	/* on a per-cpu tty_hangup_batches list, see tty_hangup() */
 	void *disc_data;
 	void *driver_data;
+	spinlock_t files_lock;		/* protects tty_files list */
 	struct list_head tty_files;
 
 #define N_TTY_BUF_SIZE 4096
@@ -92,10 +192,16 @@ struct tty_struct {
 	int closing;
 	unsigned char *write_buf;
 	int write_cnt;
+	unsigned int write_chunk;	/* adaptive do_tty_write() chunk size */
 	/* If the tty has a pending do_SAK, queue it here - akpm */
 	struct work_struct SAK_work;
 	struct tty_port *port;
+	struct rcu_head rcu;	/* deferred free, see tty_reopen_fast() */
 };
+#define TTY_HANGUP_QUEUED	23	/* tty->flags: on a tty_hangup_batches list */
+#define TTY_LDISC_SWITCHING	24	/* tty->flags: tty_set_ldisc() opening the new ldisc */
+#define TTY_PTY_DIRECT		25	/* tty->flags: pty_write_direct() feeding its ldisc */
+#define TTY_HANGUP_RUNNING	26	/* tty->flags: tty_hangup_batch() in __tty_hangup() */
 
 
 struct tty_driver {
@@ -130,6 +236,21 @@ struct tty_driver {
 
 	const struct tty_operations *ops;
 	struct list_head tty_drivers;
+	struct rcu_head rcu;	/* destruct_tty_driver() frees with kfree_rcu() */
+
+	struct tty_xmit_pool *xmit_pool;	/* optional, see tty_xmit_pool_create() */
+};
+
+/* Free xmit_buf pages of one driver, one list per NUMA node */
+struct tty_xmit_pool {
+	unsigned int max;		/* pages kept per node */
+	atomic_long_t allocated;	/* pages taken from the page allocator */
+	atomic_long_t reused;		/* pages served from the pool */
+	struct tty_xmit_pool_node {
+		spinlock_t lock;
+		struct list_head pages;	/* linked through page->lru */
+		unsigned int count;
+	} node[];			/* nr_node_ids entries */
 };
 struct tty_port {
     struct tty_bufhead  buf;        /* Locked internally */
@@ -148,6 +269,9 @@ struct tty_port {
     struct mutex        mutex;      /* Locking */
     struct mutex        buf_mutex;  /* Buffer alloc lock */
     unsigned char       *xmit_buf;  /* Optional buffer */
+    struct tty_xmit_pool *xmit_pool;    /* from the driver, may be NULL */
+    int         node;       /* NUMA node of the port's irq,
+                           NUMA_NO_NODE from tty_port_init() */
     unsigned int        close_delay;    /* Close port delay */
     unsigned int        closing_wait;   /* Delay for output */
     int         drain_delay;    /* Set to zero if no pure time
@@ -162,10 +286,24 @@ struct tty_bufhead {
     atomic_t       priority;
     struct tty_buffer sentinel;
     struct llist_head free;     /* Free queue head */
+    spinlock_t     free_lock;   /* llist_del_first() vs the shrinker's llist_del_all() */
     atomic_t       mem_used;    /* In-use buffers excluding free list */
     int        mem_limit;
     struct tty_buffer *tail;    /* Active buffer */
+    u32        seq;         /* last tty_buffer seq, written by the producer with WRITE_ONCE() */
+    u32        push_seq;    /* tty_flip_push: buffer and offset */
+    int        push_off;    /*   the last push published up to */
+    u32        rx_seq;      /* n_tty_receive: source of the bytes */
+    int        rx_off;      /*   being handed to the ldisc */
+    int        flush_mode;  /* TTY_FLUSH_*, where buf.work runs */
+    int        flush_cpu;   /* TTY_FLUSH_CPU target, last reader cpu */
+    unsigned long  last_alloc;  /* jiffies, idle ports lose their free list; READ_ONCE()/WRITE_ONCE() */
+    struct list_head node;  /* tty_buffer_ports while free is not empty */
 };
+#define TTY_FLUSH_UNBOUND   0   /* system_unbound_wq (default) */
+#define TTY_FLUSH_IRQ       1   /* cpu that called tty_flip_buffer_push() */
+#define TTY_FLUSH_READER    2   /* cpu of the last read() */
+#define TTY_FLUSH_CPU       3   /* fixed, flush_cpu */
 struct tty_buffer {
     union {
         struct tty_buffer *next;
@@ -176,6 +314,8 @@ struct tty_buffer {
     int commit;
     int read;
     int flags;
+    int borrowed;   /* above mem_limit, charged to tty_flip_budget */
+    u32 seq;        /* per port, for tracing */
     /* Data points here */
     unsigned long data[0];
 };